@@ -11,18 +11,310 @@
 // include files -----
 //
 #include "adc.h"
-#include <stdbool.h>
-#include <avr/sleep.h>
 #include <avr/io.h>
 #include <avr/signal.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <stdbool.h>
+
+/**
+ * Scan table entry.
+ */
+typedef struct {
+  uint8_t   admux;     ///< Multiplexer and reference selection
+  int8_t    channel;   ///< Snapshot channel, -1 to throw the result away
+} ScanEntry;
+
+// Throw-away conversions are needed after switching to
+// a differential channel, after reference changes and
+// before the bandgap reading.
+//
+static const ScanEntry scanTable[] PROGMEM = {
+  { _BV(REFS0) | 0x10,               -1              },  // 1x (ADC0 - ADC1)
+  { _BV(REFS0) | 0x10,               ADC_GYRO        },
+  { _BV(REFS0) | 0x09,               -1              },  // 10x (ADC1 - ADC0)
+  { _BV(REFS0) | 0x09,               ADC_GYRO_10X    },
+  { _BV(REFS0) | 2,                  -1              },  // single ended, AVcc
+  { _BV(REFS0) | 2,                  ADC_ACCEL_X     },
+  { _BV(REFS0) | 3,                  ADC_ACCEL_Y     },
+  { _BV(REFS0) | 4,                  ADC_ACCEL_Z     },
+  { _BV(REFS0) | 5,                  ADC_BATTERY     },
+  { _BV(REFS0) | _BV(REFS1) | 6,     -1              },  // 2.56V bandgap
+  { _BV(REFS0) | _BV(REFS1) | 6,     ADC_PSD1        },
+  { _BV(REFS0) | _BV(REFS1) | 7,     ADC_PSD2        },
+  { _BV(REFS0) | 0x1E,               -1              },  // 1.23V bandgap against AVcc
+  { _BV(REFS0) | 0x1E,               ADC_BANDGAP     },
+};
+
+#define  SCAN_LENGTH  (sizeof(scanTable) / sizeof(scanTable[0]))
+
+/**
+ * Oversampling and filter state of one channel.
+ */
+typedef struct {
+  uint8_t   oversample;  ///< Decimate 4^oversample conversions
+  uint8_t   filter;      ///< ADC_FILTER_xxx
+  uint8_t   shift;       ///< IIR time constant or log2 of average length
+  bool      primed;      ///< Filter holds at least one sample
+  uint8_t   count;       ///< Conversions in sum
+  int16_t   sum;         ///< Sum of signed conversions
+  int32_t   acc;         ///< IIR accumulator or moving average sum
+  uint8_t   pos;         ///< Moving average position
+  int16_t   window[ADC_AVERAGE_LENGTH];
+} Filter;
+
+static volatile unsigned  snapshot[2][ADC_CHANNELS];
+static volatile uint16_t  filtered[ADC_CHANNELS];  ///< Left-justified, 16 bit
+static Filter             filters[ADC_CHANNELS];
+static volatile uint8_t   front;      ///< Snapshot buffer of the last complete scan
+static volatile uint8_t   scanCount;  ///< Number of complete scans
+static uint8_t            scanPos;    ///< Current entry in scan table
+static volatile uint8_t   activity;   ///< Incremented by every ADC interrupt
+static uint8_t            checked;    ///< activity at the last ADC_CheckScan()
+static uint8_t            restarts;   ///< Scan restarts by ADC_CheckScan()
+
+// ADC clock for scans (125kHz) and captures (250kHz).
+//
+// ADCSRA is always written with one of these values, never
+// read-modify-written: a read returns ADIF set if a conversion
+// completed meanwhile, and writing that back clears the flag.
+// The interrupt would be lost and the scan would stop. Writing
+// ADSC as 0 has no effect on a running conversion.
+//
+#define  SCAN_ADCSRA     (_BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0))
+#define  CAPTURE_ADCSRA  (_BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1))
+
+// Timer0 prescaler settings (CS02..CS00 = index+1)
+//
+static const uint16_t timerPrescale[] PROGMEM = { 1, 8, 32, 64, 128, 256, 1024 };
+
+static volatile uint8_t   capState;               ///< ADC_CAPTURE_xxx
+static volatile bool      capBusy;                ///< Capture conversion in progress
+static bool               capSettle;              ///< Discard the first set
+static uint8_t            capMux[ADC_CHANNELS];   ///< ADMUX of captured channels
+static uint8_t            capCount;               ///< Number of captured channels
+static uint8_t            capPos;                 ///< Current channel in set
+static uint8_t            capTrigger;             ///< Trigger index in set
+static uint8_t            capEdge;                ///< ADC_RISING or ADC_FALLING
+static uint16_t           capLevel;               ///< Trigger level
+static uint16_t           capPrev;                ///< Previous trigger sample
+static uint16_t           capPre;                 ///< Pre-trigger sets
+static uint16_t           capSets;                ///< Sets in buffer, saturated
+static uint16_t           capSize;                ///< Sets in ring
+static uint16_t           capRemain;              ///< Sets left after trigger
+static uint16_t           capLength;              ///< Samples in ring
+static uint16_t           capWrite;               ///< Ring write position
+static volatile uint8_t   capOverruns;            ///< Timer ticks missed
+static uint16_t           capBuf[ADC_CAPTURE_SAMPLES];
+
+
+/**
+ * Feed a conversion into the filter chain of a channel.
+ *
+ * 4^n conversions are summed and decimated to 10+n bits.
+ * The filter runs on values scaled to 16 bits, the result
+ * is scaled back to 10+n bits. The extra bits are only
+ * meaningful with enough noise on the input, which the
+ * sensors have plenty of.
+ *
+ * Filtering is done on signed values: differential
+ * conversions are sign extended, single ended ones are
+ * taken relative to mid scale.
+ */
+static inline void FilterSample(uint8_t channel, uint16_t value)
+{
+  Filter *f = &filters[channel];
+  bool    differential = channel == ADC_GYRO || channel == ADC_GYRO_10X;
+
+  f->sum += differential ? (int16_t)(value << 6) >> 6 : (int16_t)value - 512;
+  if (++f->count < (1 << (2 * f->oversample)))
+    return;
+
+  int16_t x = f->sum * (1 << (6 - 2 * f->oversample));
+  f->sum   = 0;
+  f->count = 0;
+
+  switch (f->filter) {
+    case ADC_FILTER_IIR:
+      // y[n] = y[n-1] + (x[n] - y[n-1]) / 2^shift,
+      // with y scaled by 2^shift in acc.
+      //
+      if (!f->primed)
+        f->acc = (int32_t)x * (1 << f->shift);
+      else
+        f->acc += x - (f->acc >> f->shift);
+      x = f->acc >> f->shift;
+      break;
+
+    case ADC_FILTER_AVERAGE: {
+      uint8_t len = 1 << f->shift;
+      if (!f->primed) {
+        for (uint8_t i=0; i<len; i++)
+          f->window[i] = x;
+        f->acc = (int32_t)x * (1 << f->shift);
+      }
+      f->acc -= f->window[f->pos];
+      f->acc += x;
+      f->window[f->pos] = x;
+      f->pos = (f->pos + 1) & (len - 1);
+      x = f->acc >> f->shift;
+      break;
+    }
+  }
+  f->primed = true;
+
+  // Back to the format of a raw conversion with 10+n bits,
+  // so unfiltered values are unchanged
+  //
+  uint8_t  bits = 10 + f->oversample;
+  uint16_t y    = x >> (6 - f->oversample);
+  filtered[channel] = differential ? y & ((1 << bits) - 1) : y + (1 << (bits - 1));
+}
+
+
+/**
+ * Start the sensor scan at the first table entry.
+ * Must be called with interrupts disabled.
+ */
+static void StartScan()
+{
+  scanPos = 0;
+  ADMUX   = pgm_read_byte(&scanTable[0].admux);
+  ADCSRA  = SCAN_ADCSRA | _BV(ADSC);
+}
+
+
+/**
+ * Stop the capture timer and resume the sensor scan.
+ * Must be called with interrupts disabled.
+ */
+static void EndCapture(uint8_t state)
+{
+  TCCR0     = 0;
+  TIMSK    &= ~_BV(OCIE0);
+  capBusy   = false;
+  activity++;
+  capState  = state;
+  StartScan();
+}
+
+
+/**
+ * Store a capture conversion. Called from the ADC
+ * interrupt, starts the next channel of the set or
+ * runs the trigger logic when the set is complete.
+ */
+static inline void CaptureSample(uint16_t value)
+{
+  capBuf[capWrite] = value;
+  if (++capWrite == capLength)
+    capWrite = 0;
+
+  if (++capPos < capCount) {
+    ADMUX  = capMux[capPos];
+    ADCSRA = CAPTURE_ADCSRA | _BV(ADSC);
+    return;
+  }
+  capBusy = false;
+
+  if (capSettle) {
+    capSettle = false;
+    capWrite  = 0;
+    return;
+  }
+
+  if (capSets < capSize)
+    capSets++;
+
+  if (capState == ADC_CAPTURE_ARMED) {
+    // Trigger once the pre-trigger part is filled.
+    // The set just stored is the trigger set.
+    //
+    bool fire = capSets > capPre;
+
+    if (capTrigger < capCount) {
+      uint16_t pos = capWrite + capTrigger;
+      if (pos < capCount)
+        pos += capLength;
+      uint16_t cur = capBuf[pos - capCount];
+
+      if (capEdge == ADC_RISING)
+        fire = fire && capPrev <  capLevel && cur >= capLevel;
+      else
+        fire = fire && capPrev >  capLevel && cur <= capLevel;
+      capPrev = cur;
+    }
+
+    if (fire) {
+      capState  = ADC_CAPTURE_TRIGGERED;
+      capRemain = capSize - capPre - 1;
+    }
+  }
+  else if (capRemain)
+    capRemain--;
+
+  if (capState == ADC_CAPTURE_TRIGGERED && !capRemain)
+    EndCapture(ADC_CAPTURE_DONE);
+}
 
-static volatile bool adc_ready;
 
 // interrupt handlers -----
 //
+SIGNAL(SIG_OUTPUT_COMPARE0)
+{
+  // The mega128 ADC has no auto trigger, so the
+  // capture timer starts each set of conversions.
+  //
+  if (capBusy || (ADCSRA & _BV(ADSC))) {
+    capOverruns++;
+    return;
+  }
+  capBusy = true;
+  capPos  = 0;
+  ADMUX   = capMux[0];
+  ADCSRA  = CAPTURE_ADCSRA | _BV(ADSC);
+}
+
+
 SIGNAL(SIG_ADC)
 {
-  adc_ready = true;  
+  activity++;
+  if (capState == ADC_CAPTURE_ARMED || capState == ADC_CAPTURE_TRIGGERED) {
+    // Conversions not started by the capture timer
+    // are left over from the scan
+    //
+    if (capBusy)
+      CaptureSample(ADC);
+    return;
+  }
+
+  uint16_t value   = ADC;
+  int8_t   channel = pgm_read_byte(&scanTable[scanPos].channel);
+  if (channel >= 0)
+    snapshot[front ^ 1][channel] = value;
+
+  if (++scanPos == SCAN_LENGTH) {
+    scanPos = 0;
+    front  ^= 1;
+    scanCount++;
+  }
+
+  ADMUX   = pgm_read_byte(&scanTable[scanPos].admux);
+  ADCSRA  = SCAN_ADCSRA | _BV(ADSC);
+
+  // Filter with interrupts enabled, so the servo output
+  // stage isn't held off. The next conversion is already
+  // running and takes much longer. If it completes while
+  // the attitude or servo interrupts hold us up, ADIF stays
+  // set and the interrupt follows once ADIE is back on.
+  //
+  if (channel >= 0) {
+    ADCSRA = SCAN_ADCSRA & ~_BV(ADIE);
+    sei();
+    FilterSample(channel, value);
+    cli();
+    ADCSRA = SCAN_ADCSRA;
+  }
 }
 
 
@@ -33,21 +325,337 @@ void ADC_Init()
   DDRF  = 0;
   PORTF = 0x00;
 
-  // Enable ADC, ~8kSamples/s, interrupt enabled
+  // Enable ADC, ~8kSamples/s, interrupt enabled.
+  // The first conversion starts the scan, it runs
+  // as soon as interrupts are enabled.
   // 
-  ADCSRA = _BV(ADEN)  | _BV(ADIE)  | 
-           _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  capState = ADC_CAPTURE_IDLE;
+  StartScan();
 }
 
 
-unsigned ADC_Read()
+/**
+ * Start a burst capture.
+ *
+ * The sensor scan is suspended, Timer0 starts a set of
+ * conversions of the selected channels at the sample rate.
+ * Sets are stored in a ring of ADC_CAPTURE_SAMPLES values
+ * until the trigger fires and the buffer is filled up.
+ * The scan resumes when the capture is done or stopped,
+ * ADC_Read() returns the last scan values until then.
+ *
+ * Only single ended channels with the same reference can
+ * be captured together, they need no throw-away conversion
+ * when switching. The first set is discarded, to let the
+ * reference settle after the scan.
+ *
+ * \param  c  capture parameters
+ * \return false, if a parameter is out of range
+ */
+bool ADC_StartCapture(const ADC_Capture *c)
 {
-  // Don't use SLEEP_MODE_ADC, because it would stop the UARTs.
+  uint8_t count = 0, trigger = ADC_NO_TRIGGER;
+  uint8_t mux[ADC_CHANNELS];
+
+  for (uint8_t ch=0; ch<ADC_CHANNELS; ch++) {
+    if (!(c->channels & (1 << ch)))
+      continue;
+    if (ch == c->trigger)
+      trigger = count;
+    for (uint8_t i=0; i<SCAN_LENGTH; i++) {
+      if ((int8_t)pgm_read_byte(&scanTable[i].channel) == ch)
+        mux[count] = pgm_read_byte(&scanTable[i].admux);
+    }
+
+    // Differential and bandgap channels need settle
+    // conversions, and differential ones a slower clock
+    //
+    if ((mux[count] & 0x1F) >= 0x08)
+      return false;
+    if ((mux[count] ^ mux[0]) & (_BV(REFS1) | _BV(REFS0)))
+      return false;
+    count++;
+  }
+  if (!count || c->rate == 0 || (uint32_t)c->rate * count > ADC_CAPTURE_MAX_RATE)
+    return false;
+  if (c->pretrigger >= ADC_CAPTURE_SAMPLES / count)
+    return false;
+  if (c->trigger != ADC_NO_TRIGGER && trigger == ADC_NO_TRIGGER)
+    return false;
+
+  // Select the smallest Timer0 prescaler that fits
+  //
+  uint8_t  cs;
+  uint32_t top = 0;
+  for (cs=0; cs<sizeof(timerPrescale)/sizeof(timerPrescale[0]); cs++) {
+    top = F_CPU / pgm_read_word(&timerPrescale[cs]) / c->rate;
+    if (top <= 256)
+      break;
+  }
+  if (top > 256 || top < 2)
+    return false;
+
+  uint8_t sreg = SREG;
+  cli();
+  TCCR0 = 0;
+  for (uint8_t i=0; i<count; i++)
+    capMux[i] = mux[i];
+  capCount    = count;
+  capTrigger  = trigger;
+  capEdge     = c->edge;
+  capLevel    = c->level;
+  capPrev     = c->edge == ADC_RISING ? 0xffff : 0;
+  capPre      = c->pretrigger;
+  capSets     = 0;
+  capRemain   = 0;
+  capSize     = ADC_CAPTURE_SAMPLES / count;
+  capLength   = capSize * count;
+  capWrite    = 0;
+  capOverruns = 0;
+  capBusy     = false;
+  capSettle   = true;
+  capState    = ADC_CAPTURE_ARMED;
+
+  ADCSRA = CAPTURE_ADCSRA;
+  OCR0   = top - 1;
+  TCNT0  = 0;
+  TIFR   = _BV(OCF0);
+  TIMSK |= _BV(OCIE0);
+  TCCR0  = _BV(WGM01) | (cs + 1);
+  SREG = sreg;
+
+  return true;
+}
+
+
+/**
+ * Stop a running capture and resume the sensor scan.
+ * A completed capture stays available for reading.
+ */
+void ADC_StopCapture()
+{
+  uint8_t sreg = SREG;
+  cli();
+  if (capState == ADC_CAPTURE_ARMED || capState == ADC_CAPTURE_TRIGGERED)
+    EndCapture(ADC_CAPTURE_IDLE);
+  SREG = sreg;
+}
+
+
+/**
+ * Get capture status.
+ *
+ * \param  overruns  receives the number of missed sample
+ *                   ticks (modulo 256), may be NULL
+ * \return ADC_CAPTURE_xxx
+ */
+uint8_t ADC_CaptureState(uint8_t *overruns)
+{
+  if (overruns)
+    *overruns = capOverruns;
+  return capState;
+}
+
+
+/**
+ * Read a completed capture.
+ *
+ * Values are returned in time order, channels of a set in
+ * ascending channel order. The set at pretrigger * channels
+ * is the one that fired the trigger.
+ *
+ * \param  offset  first value
+ * \param  values  receives the values
+ * \param  count   number of values to read
+ * \return number of values read, 0 past the end or if
+ *         no capture is complete
+ */
+uint16_t ADC_ReadCapture(uint16_t offset, unsigned *values, uint16_t count)
+{
+  if (capState != ADC_CAPTURE_DONE || offset >= capLength)
+    return 0;
+  if (count > capLength - offset)
+    count = capLength - offset;
+
+  // The ring is full, the oldest set is at the write position
   //
-  set_sleep_mode(SLEEP_MODE_IDLE);
-  adc_ready = false;
-  sleep_mode();
-  while (!adc_ready);
-  return ADC; 
+  uint16_t pos = capWrite + offset;
+  if (pos >= capLength)
+    pos -= capLength;
+  for (uint16_t i=0; i<count; i++) {
+    values[i] = capBuf[pos];
+    if (++pos == capLength)
+      pos = 0;
+  }
+  return count;
+}
+
+
+/**
+ * Get a channel of the last complete scan.
+ *
+ * \param  channel  snapshot channel, see ADC_GYRO etc.
+ */
+unsigned ADC_Read(uint8_t channel)
+{
+  uint8_t sreg = SREG;
+  cli();
+  unsigned value = snapshot[front][channel];
+  SREG = sreg;
+  return value;
 }
 
+
+/**
+ * Get all channels of the last complete scan.
+ *
+ * \param  values  receives ADC_CHANNELS values, all
+ *                 from the same scan
+ */
+void ADC_GetSnapshot(unsigned *values)
+{
+  uint8_t sreg = SREG;
+  cli();
+  for (uint8_t i=0; i<ADC_CHANNELS; i++)
+    values[i] = snapshot[front][i];
+  SREG = sreg;
+}
+
+
+/**
+ * Get the filtered value of all channels.
+ *
+ * \param  values  receives ADC_CHANNELS values with
+ *                 10 + oversample bits, in the format of
+ *                 raw conversions (differential channels
+ *                 in two's complement)
+ */
+void ADC_GetFiltered(unsigned *values)
+{
+  uint8_t sreg = SREG;
+  cli();
+  for (uint8_t i=0; i<ADC_CHANNELS; i++)
+    values[i] = filtered[i];
+  SREG = sreg;
+}
+
+
+/**
+ * Get the filtered value of a channel as a signed number.
+ *
+ * \param  channel  snapshot channel
+ * \return filtered value in 1/64 counts, differential
+ *         channels sign extended, single ended ones
+ *         relative to mid scale
+ */
+int16_t ADC_GetFilteredSigned(uint8_t channel)
+{
+  uint8_t sreg = SREG;
+  cli();
+  uint16_t y  = filtered[channel];
+  uint8_t  os = filters[channel].oversample;
+  SREG = sreg;
+
+  uint8_t bits = 10 + os;
+  int16_t x    = (channel == ADC_GYRO || channel == ADC_GYRO_10X) ?
+                 (int16_t)(y << (16 - bits)) >> (16 - bits) :
+                 (int16_t)(y - (1 << (bits - 1)));
+  return x * (1 << (6 - os));
+}
+
+
+/**
+ * Check filter parameters without applying them.
+ * Parameters are as for ADC_SetFilter().
+ *
+ * \return false, if a parameter is out of range
+ */
+bool ADC_CheckFilter(uint8_t channel, uint8_t oversample,
+                     uint8_t filter, uint8_t shift)
+{
+  if (channel >= ADC_CHANNELS || oversample > ADC_MAX_OVERSAMPLE)
+    return false;
+
+  switch (filter) {
+    case ADC_FILTER_NONE:
+      return true;
+    case ADC_FILTER_IIR:
+      return shift >= 1 && shift <= ADC_MAX_IIR_SHIFT;
+    case ADC_FILTER_AVERAGE:
+      return shift >= 1 && shift <= ADC_MAX_AVERAGE_SHIFT;
+    default:
+      return false;
+  }
+}
+
+
+/**
+ * Configure oversampling and filtering of a channel.
+ * The filter restarts from the next conversion.
+ *
+ * \param  channel     snapshot channel
+ * \param  oversample  decimate 4^oversample conversions,
+ *                     0..ADC_MAX_OVERSAMPLE
+ * \param  filter      ADC_FILTER_NONE, _IIR or _AVERAGE
+ * \param  shift       IIR time constant (1..ADC_MAX_IIR_SHIFT)
+ *                     or log2 of moving average length
+ *                     (1..ADC_MAX_AVERAGE_SHIFT)
+ * \return false, if a parameter is out of range
+ */
+bool ADC_SetFilter(uint8_t channel, uint8_t oversample,
+                   uint8_t filter, uint8_t shift)
+{
+  if (!ADC_CheckFilter(channel, oversample, filter, shift))
+    return false;
+  if (filter == ADC_FILTER_NONE)
+    shift = 0;
+
+  uint8_t sreg = SREG;
+  cli();
+  Filter *f = &filters[channel];
+  f->oversample = oversample;
+  f->filter     = filter;
+  f->shift      = shift;
+  f->primed     = false;
+  f->count      = 0;
+  f->sum        = 0;
+  f->pos        = 0;
+  SREG = sreg;
+
+  return true;
+}
+
+
+/**
+ * Number of complete scans, modulo 256.
+ * Changes when a new snapshot is available.
+ *
+ */
+uint8_t ADC_ScanCount()
+{
+  return scanCount;
+}
+
+
+/**
+ * Check that the sensor scan is still running, and
+ * restart it if not. Call at intervals of a few scans
+ * (a scan takes ~1.5ms), e.g. once per servo frame.
+ * Running captures are left alone.
+ *
+ * \return number of restarts, modulo 256. Anything
+ *         but 0 means an ADC interrupt was lost.
+ */
+uint8_t ADC_CheckScan()
+{
+  uint8_t sreg = SREG;
+  cli();
+  if (capState != ADC_CAPTURE_ARMED && capState != ADC_CAPTURE_TRIGGERED &&
+      activity == checked) {
+    restarts++;
+    StartScan();
+  }
+  checked = activity;
+  SREG = sreg;
+  return restarts;
+}
@@ -10,8 +10,73 @@
 #ifndef ADC_H
 #define ADC_H
 
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Snapshot channels, in CMD_READ_SENSORS order
+//
+#define  ADC_GYRO        0    ///< Gyro, 1x (ADC0 - ADC1)
+#define  ADC_GYRO_10X    1    ///< Gyro, 10x (ADC1 - ADC0)
+#define  ADC_ACCEL_X     2    ///< Accelerometer X (ADC2)
+#define  ADC_ACCEL_Y     3    ///< Accelerometer Y (ADC3)
+#define  ADC_ACCEL_Z     4    ///< Accelerometer Z (ADC4)
+#define  ADC_BATTERY     5    ///< Battery voltage (ADC5)
+#define  ADC_PSD1        6    ///< PSD sensor against 2.56V (ADC6)
+#define  ADC_PSD2        7    ///< PSD sensor against 2.56V (ADC7)
+#define  ADC_BANDGAP     8    ///< 1.23V bandgap against AVcc
+#define  ADC_CHANNELS    9    ///< Number of snapshot channels
+
+// Channel filters (ADC_SetFilter)
+//
+#define  ADC_FILTER_NONE        0    ///< Decimated value only
+#define  ADC_FILTER_IIR         1    ///< First order low pass
+#define  ADC_FILTER_AVERAGE     2    ///< Moving average
+
+#define  ADC_MAX_OVERSAMPLE     3    ///< 64 conversions, 13 bits
+#define  ADC_MAX_IIR_SHIFT      7
+#define  ADC_MAX_AVERAGE_SHIFT  3
+#define  ADC_AVERAGE_LENGTH     (1 << ADC_MAX_AVERAGE_SHIFT)
+
+// Burst capture (ADC_StartCapture)
+//
+#define  ADC_CAPTURE_SAMPLES    192    ///< Size of capture ring
+#define  ADC_CAPTURE_MAX_RATE   16000  ///< Max. conversions per second
+
+#define  ADC_CAPTURE_IDLE       0      ///< No capture
+#define  ADC_CAPTURE_ARMED      1      ///< Filling, waiting for trigger
+#define  ADC_CAPTURE_TRIGGERED  2      ///< Filling post-trigger part
+#define  ADC_CAPTURE_DONE       3      ///< Capture complete
+
+#define  ADC_NO_TRIGGER         0xFF   ///< Trigger after pre-trigger part
+#define  ADC_RISING             0
+#define  ADC_FALLING            1
+
+/**
+ * Capture parameters.
+ */
+typedef struct {
+  uint16_t  channels;     ///< Bit mask of single ended channels, one reference
+  uint16_t  rate;         ///< Sets per second
+  uint16_t  pretrigger;   ///< Sets kept before the trigger
+  uint8_t   trigger;      ///< Trigger channel, or ADC_NO_TRIGGER
+  uint8_t   edge;         ///< ADC_RISING or ADC_FALLING
+  uint16_t  level;        ///< Trigger level (raw conversion)
+} ADC_Capture;
 
 extern void      ADC_Init();
-extern unsigned  ADC_Read();
+extern unsigned  ADC_Read(uint8_t channel);
+extern void      ADC_GetSnapshot(unsigned *values);
+extern void      ADC_GetFiltered(unsigned *values);
+extern int16_t   ADC_GetFilteredSigned(uint8_t channel);
+extern bool      ADC_CheckFilter(uint8_t channel, uint8_t oversample,
+                                 uint8_t filter, uint8_t shift);
+extern bool      ADC_SetFilter(uint8_t channel, uint8_t oversample,
+                               uint8_t filter, uint8_t shift);
+extern uint8_t   ADC_ScanCount();
+extern uint8_t   ADC_CheckScan();
+extern bool      ADC_StartCapture(const ADC_Capture *c);
+extern void      ADC_StopCapture();
+extern uint8_t   ADC_CaptureState(uint8_t *overruns);
+extern uint16_t  ADC_ReadCapture(uint16_t offset, unsigned *values, uint16_t count);
 
 #endif
@@ -0,0 +1,226 @@
+/*  $Id$
+    Copyright (c)2006 by Thomas Kindler, thomas.kindler@gmx.de
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of
+    the License, or (at your option) any later version. Read the
+    full License at http://www.gnu.org/copyleft for more details.
+*/
+
+// include files -----
+//
+#include "attitude.h"
+#include "adc.h"
+#include <avr/io.h>
+#include <avr/signal.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#define  GYRO_LIMIT     480    ///< Switch to 1x gyro channel above this
+#define  CALIB_SAMPLES  ATT_RATE  ///< Initial gyro bias calibration
+#define  REST_RATE      16     ///< Max. gyro deviation at rest [counts]
+#define  REST_SAMPLES   (ATT_RATE/2)  ///< Samples below REST_RATE for rest
+#define  BIAS_SHIFT     6      ///< Bias tracking, 1/2^BIAS_SHIFT per sample
+
+// atan(2^-i), 65536 = 360 degrees
+//
+static const uint16_t atanTable[] PROGMEM = {
+  8192, 4836, 2555, 1297, 651, 326, 163, 81, 41, 20, 10, 5, 3, 1
+};
+
+// Defaults assume about 25.6 counts per deg/s on the
+// 10x gyro channel, with the accelerometer centered.
+//
+static ATT_Config config = {
+  { 512, 512, 512 }, 1864, 8, ATT_PITCH
+};
+
+static uint32_t  angle[2];     ///< Pitch and roll, 2^32 = 360 degrees
+static int32_t   bias;         ///< Gyro bias, 1/256 counts
+static int32_t   biasSum;      ///< Sum of calibration samples
+static uint16_t  samples;      ///< Calibration samples so far
+static int16_t   rate;         ///< Last bias corrected rate, 1/4 counts
+static int16_t   filteredRate; ///< Same, from the filtered channels
+static uint8_t   restCount;    ///< Consecutive samples at rest
+static uint8_t   lastScan;     ///< ADC scan of the last update
+
+
+/**
+ * Sign extend a differential conversion.
+ */
+static inline int16_t Signed10(unsigned value)
+{
+  return (int16_t)(value << 6) >> 6;
+}
+
+
+/**
+ * Angle of a vector, CORDIC vectoring mode.
+ *
+ * \return  atan2(y, x), 65536 = 360 degrees
+ */
+static int16_t Atan2(int16_t y, int16_t x)
+{
+  int32_t  xs = (int32_t)x << 14;
+  int32_t  ys = (int32_t)y << 14;
+  uint16_t a  = 0;
+
+  if (xs < 0) {
+    xs = -xs;
+    ys = -ys;
+    a  = 32768;
+  }
+  for (uint8_t i=0; i<sizeof(atanTable)/sizeof(atanTable[0]); i++) {
+    int32_t t = xs;
+    uint16_t step = pgm_read_word(&atanTable[i]);
+    if (ys > 0) {
+      xs += ys >> i;
+      ys -= t  >> i;
+      a  += step;
+    }
+    else {
+      xs -= ys >> i;
+      ys += t  >> i;
+      a  -= step;
+    }
+  }
+  return a;
+}
+
+
+/**
+ * Run one estimator step on the latest ADC scan.
+ */
+static void Update()
+{
+  // No new scan while the ADC is capturing
+  //
+  uint8_t scan = ADC_ScanCount();
+  if (scan == lastScan)
+    return;
+  lastScan = scan;
+
+  unsigned v[ADC_CHANNELS];
+  ADC_GetSnapshot(v);
+
+  // Use the 10x gyro channel (ADC1 - ADC0) unless it
+  // saturates, scale the 1x channel (ADC0 - ADC1) else.
+  //
+  int16_t g10 = Signed10(v[ADC_GYRO_10X]);
+  int16_t counts = (g10 > -GYRO_LIMIT && g10 < GYRO_LIMIT) ?
+                   -g10 : Signed10(v[ADC_GYRO]) * 10;
+
+  // Average the first second for an initial bias,
+  // then track it slowly while the gyro is at rest.
+  //
+  if (samples < CALIB_SAMPLES) {
+    biasSum += counts;
+    if (++samples == CALIB_SAMPLES)
+      bias = (biasSum << 8) / CALIB_SAMPLES;
+  }
+
+  int32_t r = ((int32_t)counts << 8) - bias;
+
+  if (samples == CALIB_SAMPLES && r > -(REST_RATE << 8) && r < (REST_RATE << 8)) {
+    if (restCount < REST_SAMPLES)
+      restCount++;
+    else
+      bias += r >> BIAS_SHIFT;
+  }
+  else
+    restCount = 0;
+
+  rate = r >> 6;
+
+  // The same rate from the filtered gyro channels, in
+  // 1/64 counts. It lags behind, so the estimator keeps
+  // using the raw one, the balance feedback uses this.
+  //
+  int32_t f10 = ADC_GetFilteredSigned(ADC_GYRO_10X);
+  int32_t fc  = (f10 > -(GYRO_LIMIT << 6) && f10 < (GYRO_LIMIT << 6)) ?
+                -f10 : (int32_t)ADC_GetFilteredSigned(ADC_GYRO) * 10;
+  filteredRate = ((fc << 2) - bias) >> 6;
+
+  // Complementary filter: integrate the gyro and pull
+  // both angles towards the accelerometer tilt.
+  //
+  int16_t ax = v[ADC_ACCEL_X] - config.accelZero[0];
+  int16_t ay = v[ADC_ACCEL_Y] - config.accelZero[1];
+  int16_t az = v[ADC_ACCEL_Z] - config.accelZero[2];
+
+  int16_t tilt[2];
+  tilt[ATT_PITCH] = Atan2(ax, az);
+  tilt[ATT_ROLL]  = Atan2(ay, az);
+
+  if (samples == CALIB_SAMPLES)
+    angle[config.gyroAxis] += ((int32_t)rate * config.gyroGain) >> 2;
+
+  for (uint8_t i=0; i<2; i++) {
+    int16_t error = tilt[i] - (int16_t)(angle[i] >> 16);
+    angle[i] += ((int32_t)error * 65536) >> config.shift;
+  }
+}
+
+
+// interrupt handlers -----
+//
+SIGNAL(SIG_OUTPUT_COMPARE2)
+{
+  // The update takes a while, so let the servo and
+  // UART interrupts through.
+  //
+  TIMSK &= ~_BV(OCIE2);
+  sei();
+  Update();
+  cli();
+  TIMSK |= _BV(OCIE2);
+}
+
+
+void ATT_Init()
+{
+  // Timer2 runs the estimator, CTC mode at F_CPU/256
+  //
+  OCR2   = F_CPU/256 / ATT_RATE - 1;
+  TCCR2  = _BV(WGM21) | _BV(CS22);
+  TIMSK |= _BV(OCIE2);
+}
+
+
+/**
+ * Set estimator configuration.
+ *
+ * \param  c  new configuration
+ * \return false, if a parameter is out of range
+ */
+bool ATT_SetConfig(const ATT_Config *c)
+{
+  if (c->shift < 1 || c->shift > 15 || c->gyroAxis > ATT_ROLL)
+    return false;
+
+  uint8_t sreg = SREG;
+  cli();
+  config = *c;
+  SREG = sreg;
+  return true;
+}
+
+
+/**
+ * Get the current attitude estimate.
+ *
+ * \param  state  receives angles, gyro rate and bias
+ */
+void ATT_GetState(ATT_State *state)
+{
+  uint8_t sreg = SREG;
+  cli();
+  state->pitch = angle[ATT_PITCH] >> 16;
+  state->roll  = angle[ATT_ROLL]  >> 16;
+  state->rate  = rate;
+  state->filtered = filteredRate;
+  state->bias  = bias >> 6;
+  state->rest  = restCount == REST_SAMPLES;
+  SREG = sreg;
+}
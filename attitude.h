@@ -0,0 +1,49 @@
+/*  $Id$
+    Copyright (c)2006 by Thomas Kindler, thomas.kindler@gmx.de
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of
+    the License, or (at your option) any later version. Read the
+    full License at http://www.gnu.org/copyleft for more details.
+*/
+#ifndef ATTITUDE_H
+#define ATTITUDE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define  ATT_RATE         250   ///< Estimator update rate [Hz]
+
+#define  ATT_PITCH        0     ///< Gyro axis: pitch
+#define  ATT_ROLL         1     ///< Gyro axis: roll
+
+/**
+ * Estimator configuration.
+ */
+typedef struct {
+  uint16_t  accelZero[3];  ///< Accelerometer x, y, z zero-g reading
+  int16_t   gyroGain;      ///< Angle per sample per gyro count, 2^-32 turns
+  uint8_t   shift;         ///< Accelerometer correction, 1/2^shift per sample
+  uint8_t   gyroAxis;      ///< ATT_PITCH or ATT_ROLL
+} ATT_Config;
+
+/**
+ * Attitude estimate.
+ * Angles are binary, 65536 = 360 degrees. Gyro
+ * values are in 1/4 counts of the 10x channel.
+ */
+typedef struct {
+  int16_t   pitch;
+  int16_t   roll;
+  int16_t   rate;      ///< Bias corrected gyro rate
+  int16_t   filtered;  ///< Same, from the filtered gyro channels
+  int16_t   bias;      ///< Estimated gyro bias
+  bool      rest;      ///< Gyro is at rest, bias is being tracked
+} ATT_State;
+
+extern void  ATT_Init();
+extern bool  ATT_SetConfig(const ATT_Config *config);
+extern void  ATT_GetState(ATT_State *state);
+
+#endif
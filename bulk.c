@@ -0,0 +1,187 @@
+/*  $Id$
+    Copyright (c)2006 by Thomas Kindler, thomas.kindler@gmx.de
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of
+    the License, or (at your option) any later version. Read the
+    full License at http://www.gnu.org/copyleft for more details.
+*/
+
+// include files -----
+//
+#include "bulk.h"
+#include "packet.h"
+#include <avr/io.h>
+#include <avr/crc16.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <stdbool.h>
+
+#define  BLK_BUFFER_MASK  (BLK_BUFFER_SIZE - 1)
+
+#if (BLK_BUFFER_SIZE & BLK_BUFFER_MASK)
+  #error Bulk buffer size is not a power of 2
+#endif
+
+static   bool       active;      ///< Transfer in progress
+static   uint16_t   baseAddr;    ///< EEPROM address of transfer
+static   uint16_t   totalLen;    ///< Length of transfer
+static   uint16_t   totalCrc;    ///< CRC of whole transfer
+static   uint16_t   received;    ///< Bytes received so far
+static   uint16_t   written;     ///< Bytes written so far
+
+static   uint8_t    buf[BLK_BUFFER_SIZE];  ///< Received, not yet written
+static   uint8_t    head, tail;
+
+
+/**
+ * Begin a bulk EEPROM write.
+ * Beginning a transfer with the same parameters as the
+ * one in progress resumes it, see BLK_Offset().
+ *
+ * \param  addr    EEPROM address
+ * \param  length  length of transfer
+ * \param  crc     CRC-CCITT of all data, initialized with 0xffff
+ * \return ERR_OK or ERR_RANGE
+ */
+int8_t BLK_Begin(uint16_t addr, uint16_t length, uint16_t crc)
+{
+  if (length == 0 || addr > E2END || length > E2END + 1 - addr)
+    return ERR_RANGE;
+
+  if (active && addr == baseAddr && length == totalLen && crc == totalCrc)
+    return ERR_OK;
+
+  // Bytes still buffered from an abandoned
+  // transfer are dropped.
+  //
+  baseAddr = addr;
+  totalLen = length;
+  totalCrc = crc;
+  received = 0;
+  written  = 0;
+  head = tail = 0;
+  active = true;
+  return ERR_OK;
+}
+
+
+/**
+ * Add a chunk to the current transfer.
+ * Chunks must arrive in order. They are buffered and
+ * written by BLK_Poll() while more chunks arrive.
+ *
+ * \param  offset  offset of chunk in transfer
+ * \param  data    chunk data
+ * \param  len     chunk length
+ * \return
+ *   ERR_OK           chunk accepted
+ *   ERR_RANGE        no transfer, or offset isn't BLK_Offset()
+ *   ERR_DATA_LENGTH  chunk exceeds the transfer length
+ *   ERR_QUEUE_FULL   not enough buffer space, retry later
+ */
+int8_t BLK_Write(uint16_t offset, const void *data, uint8_t len)
+{
+  if (!active || offset != received)
+    return ERR_RANGE;
+  if (offset + len > totalLen)
+    return ERR_DATA_LENGTH;
+  if (len > BLK_Free())
+    return ERR_QUEUE_FULL;
+
+  const uint8_t *src = data;
+  for (uint8_t i=0; i<len; i++) {
+    buf[tail] = *src++;
+    tail = (tail+1) & BLK_BUFFER_MASK;
+  }
+  received += len;
+  return ERR_OK;
+}
+
+
+/**
+ * Finish the current transfer.
+ * The CRC is checked against the EEPROM contents, so
+ * it covers the whole path from the host to the cells.
+ *
+ * \return
+ *   ERR_OK           transfer complete and verified
+ *   ERR_RANGE        no transfer
+ *   ERR_DATA_LENGTH  data missing, resume at BLK_Offset()
+ *   ERR_QUEUE_FULL   still writing, retry later
+ *   ERR_CRC          verification failed, transfer restarts at 0
+ */
+int8_t BLK_End()
+{
+  if (!active)
+    return ERR_RANGE;
+  if (received != totalLen)
+    return ERR_DATA_LENGTH;
+  if (written != totalLen || !eeprom_is_ready())
+    return ERR_QUEUE_FULL;
+
+  uint16_t crc = 0xffff;
+  for (uint16_t i=0; i<totalLen; i++)
+    crc = _crc_ccitt_update(crc, eeprom_read_byte((uint8_t*)(baseAddr + i)));
+
+  if (crc != totalCrc) {
+    received = written = 0;
+    return ERR_CRC;
+  }
+  active = false;
+  return ERR_OK;
+}
+
+
+/**
+ * Offset of the next chunk expected.
+ * This is where the host resumes after an error.
+ *
+ */
+uint16_t BLK_Offset()
+{
+  return received;
+}
+
+
+/**
+ * Free space in the write buffer.
+ * The host shouldn't send bigger chunks.
+ *
+ */
+uint8_t BLK_Free()
+{
+  return (head - tail - 1) & BLK_BUFFER_MASK;
+}
+
+
+/**
+ * Write buffered bytes to the EEPROM.
+ * Call from the main loop. Never waits for the EEPROM,
+ * at most one write is started per call. Bytes that
+ * already have the right value are skipped.
+ *
+ */
+void BLK_Poll()
+{
+  while (head != tail && eeprom_is_ready()) {
+    uint16_t addr = baseAddr + written;
+    uint8_t  data = buf[head];
+    head = (head+1) & BLK_BUFFER_MASK;
+    written++;
+
+    EEAR = addr;
+    EECR |= _BV(EERE);
+    if (EEDR == data)
+      continue;
+
+    EEDR = data;
+    uint8_t sreg = SREG;
+    cli();
+    EECR |= _BV(EEMWE);
+    EECR |= _BV(EEWE);
+    SREG = sreg;
+    break;
+  }
+}
@@ -0,0 +1,24 @@
+/*  $Id$
+    Copyright (c)2006 by Thomas Kindler, thomas.kindler@gmx.de
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of
+    the License, or (at your option) any later version. Read the
+    full License at http://www.gnu.org/copyleft for more details.
+*/
+#ifndef BULK_H
+#define BULK_H
+
+#include <inttypes.h>
+
+#define  BLK_BUFFER_SIZE  64    ///< Size of EEPROM write buffer
+
+extern int8_t   BLK_Begin(uint16_t addr, uint16_t length, uint16_t crc);
+extern int8_t   BLK_Write(uint16_t offset, const void *data, uint8_t len);
+extern int8_t   BLK_End();
+extern uint16_t BLK_Offset();
+extern uint8_t  BLK_Free();
+extern void     BLK_Poll();
+
+#endif
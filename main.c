@@ -37,6 +37,9 @@
 #include "packet.h"
 #include "beeper.h"
 #include "servo.h"
+#include "motion.h"
+#include "bulk.h"
+#include "attitude.h"
 
 // I/O Port definitions
 //
@@ -59,30 +62,282 @@
 #define   CMD_WRITE_EEPROM   0x04    ///< Write EEPROM
 #define   CMD_READ_SERVOS    0x05    ///< Get current servo positions
 #define   CMD_WRITE_SERVOS   0x06    ///< Set servo target positions
-#define   CMD_READ_SENSORS   0x07    ///< Read analog inputs
+#define   CMD_READ_SENSORS   0x07    ///< Read filtered analog inputs
 #define   CMD_WRITE_CONFIG   0x08    ///< Write configuration to EEPROM
 #define   CMD_SET_MIN_BATT   0x09    ///< Set minimum battery level
+#define   CMD_READ_STATS     0x0A    ///< Read servo engine/CPU load statistics
+#define   CMD_READ_JITTER    0x0B    ///< Read servo edge error by channel
+#define   CMD_ADD_KEYFRAME   0x0C    ///< Queue interpolated servo keyframe
+#define   CMD_STOP_MOTION    0x0D    ///< Stop motion, drop queued keyframes
+#define   CMD_WRITE_SEQUENCE 0x0E    ///< Write motion sequence directory entry
+#define   CMD_WRITE_SEQFRAME 0x0F    ///< Write keyframe to sequence pool (blocks up to ~430ms)
+#define   CMD_PLAY_SEQUENCE  0x10    ///< Play stored motion sequence
+#define   CMD_UPDATE_SERVOS  0x11    ///< Set selected servo targets (masked/delta)
+#define   CMD_READ_CALIB     0x12    ///< Read servo calibration entries
+#define   CMD_WRITE_CALIB    0x13    ///< Write servo calibration entries
+#define   CMD_SET_FRAME_RATE 0x14    ///< Set servo frame rate
+#define   CMD_BENCH_UART     0x15    ///< Time byte-wise vs. block packet output
+#define   CMD_SET_BAUD       0x16    ///< Switch port to a new baud rate
+#define   CMD_BATCH          0x17    ///< Execute several commands, combined response
+#define   CMD_SUBSCRIBE      0x18    ///< Set telemetry channels and rate
+#define   CMD_TELEMETRY      0x19    ///< Unsolicited telemetry packet (sent only)
+#define   CMD_SET_ENCODING   0x1A    ///< Select raw or delta encoded samples
+#define   CMD_ACK_SAMPLE     0x1B    ///< Acknowledge a delta encoded sample
+#define   CMD_BULK_BEGIN     0x1C    ///< Begin or resume a bulk EEPROM write
+#define   CMD_BULK_DATA      0x1D    ///< Bulk EEPROM write chunk
+#define   CMD_BULK_END       0x1E    ///< Verify and finish a bulk EEPROM write
+#define   CMD_SET_FILTER     0x1F    ///< Set sensor oversampling and filter
+#define   CMD_READ_ATTITUDE  0x20    ///< Read pitch/roll estimate
+#define   CMD_SET_ATTITUDE   0x21    ///< Set attitude estimator configuration
+#define   CMD_READ_BALANCE   0x22    ///< Read gyro balance feedback table
+#define   CMD_WRITE_BALANCE  0x23    ///< Write gyro balance feedback table
+#define   CMD_START_CAPTURE  0x24    ///< Start triggered sensor burst capture
+#define   CMD_STOP_CAPTURE   0x25    ///< Stop sensor burst capture
+#define   CMD_READ_CAPTURE   0x26    ///< Read capture state and buffer
+
+// CMD_UPDATE_SERVOS modes
+//
+#define   UPDATE_ABSOLUTE    0x00    ///< uint16_t position per selected servo
+#define   UPDATE_DELTA       0x01    ///< int8_t delta per selected servo
+
+// Sample encodings (CMD_SET_ENCODING)
+//
+#define   ENC_RAW            0x00    ///< uint16_t per value
+#define   ENC_DELTA          0x01    ///< Zigzag varint deltas, see PKT_SendDelta()
+
+// Delta encoded telemetry needs acks for samples still in
+// the PKT_DELTA_HISTORY samples kept, or every sample falls
+// back to a keyframe. Subscriptions that send them faster
+// than the host can be expected to answer are rejected.
+//
+#define   DELTA_ACK_MS       20      ///< Assumed worst-case ack round trip
+
+// Sample streams (CMD_ACK_SAMPLE)
+//
+#define   STREAM_SENSORS     0x00    ///< CMD_READ_SENSORS and TLM_SENSORS
+#define   STREAM_SERVOS      0x01    ///< CMD_READ_SERVOS and TLM_SERVOS
+
+// Telemetry channels (CMD_SUBSCRIBE). No channels
+// unsubscribes, whatever the divider.
+//
+#define   TLM_SENSORS        0x01    ///< Sensor snapshot, as CMD_READ_SENSORS
+#define   TLM_SERVOS         0x02    ///< Servo readback, as CMD_READ_SERVOS
+#define   TLM_BATTERY        0x04    ///< Battery voltage
+
+// Servo telemetry replaces a frame by a readback. Each
+// subscribed port gives up at most one of TLM_SERVO_DIVIDER
+// frames for it, so the servos keep being driven.
+//
+#define   TLM_SERVO_DIVIDER  4       ///< Min. divider with TLM_SERVOS
+
+// Baud rate switching. After CMD_SET_BAUD the host
+// must send a valid packet at the new rate within
+// BAUD_CONFIRM_MS, or the port falls back to DEFAULT_BAUD.
+//
+#define   DEFAULT_BAUD       115200  ///< Baud rate after reset and on fallback
+#define   BAUD_CONFIRM_MS    500     ///< Time for the host to confirm a new rate
+
+#define   BAUD_FIXED         0       ///< No baud rate change in progress
+#define   BAUD_SWITCH        1       ///< Switch after the response is sent
+#define   BAUD_CONFIRM       2       ///< Waiting for host confirmation
 
 // Board configuration
 //
 #define   PROTOCOL_VERSION   0x0130  ///< Protocol version
-#define   ZOMBIE_TIMEOUT     100     ///< Force a servo update after 100ms
-#define   ZOMBIE_MAXUPDATES  10      ///< Maximum number of zombie cycles
 
 // EEPROM config area
 // (allocated from the top)
 //
 typedef struct {
   unsigned  minBattery;
+  unsigned  frameRate;
   unsigned  crc;
 } ConfigArea;
 
+// EEPROM servo calibration area
+// (allocated below the config area)
+//
+typedef struct {
+  ServoCalib  servo[24];
+  unsigned    crc;
+} CalibArea;
+
+// Gyro balance feedback sources
+//
+#define   BAL_RATE           0       ///< Filtered gyro rate, see ATT_State
+#define   BAL_PITCH          1       ///< Estimated pitch angle
+#define   BAL_ROLL           2       ///< Estimated roll angle
+
+#define   BAL_ENTRIES        8       ///< Entries in balance table
+#define   BAL_UNUSED         0xFF    ///< Servo number of unused entries
+#define   BAL_DEFAULT_LIMIT  ((uint16_t)(200 * (F_CPU/1000000)))  ///< 200us
+
+// Balance table entry: servo += source * gain / 256
+//
+typedef struct {
+  uint8_t   servo;     ///< Servo channel, or BAL_UNUSED
+  uint8_t   source;    ///< BAL_RATE, BAL_PITCH or BAL_ROLL
+  int16_t   gain;      ///< Gain in 8.8 fixed point, CPU ticks per unit
+} BalanceEntry;
+
+// EEPROM balance feedback area
+// (allocated below the calibration area)
+//
+typedef struct {
+  BalanceEntry  entry[BAL_ENTRIES];
+  uint16_t      limit;   ///< Max. offset per servo in CPU ticks
+  unsigned      crc;
+} BalanceArea;
+
+// Sample encoding state of a port
+//
+typedef struct {
+  bool        enabled;
+  PKT_Delta   sensors;
+  PKT_Delta   servos;
+  unsigned    sensorRef[ADC_CHANNELS];
+  unsigned    sensorSent[PKT_DELTA_HISTORY][ADC_CHANNELS];
+  unsigned    servoRef[24];
+  unsigned    servoSent[PKT_DELTA_HISTORY][24];
+} Encoding;
+
+#define   CONFIG_END    4096
+#define   CONFIG_ADDR   (CONFIG_END - sizeof(ConfigArea))
+#define   CALIB_ADDR    (CONFIG_ADDR - sizeof(CalibArea))
+#define   BALANCE_ADDR  (CALIB_ADDR - sizeof(BalanceArea))
+
 
 ConfigArea  configArea;
-char        packet[128];
+CalibArea   calibArea;
+BalanceArea balanceArea;
+bool        balanceActive;
 unsigned    targetPositions[24];
-int         zombieUpdates;
 uint8_t     batteryLow;
+uint16_t    mainLoops;
+uint8_t     adcRestarts;
+uint16_t    saveAddr;
+uint8_t     readbackPending;
+uint8_t     readbackSeq[UART_PORTS];
+uint8_t     baudState[UART_PORTS];
+unsigned    baudDivider[UART_PORTS];
+uint16_t    baudTimeout[UART_PORTS];
+uint32_t    frameTime;
+uint8_t     tlmChannels[UART_PORTS];
+uint8_t     tlmDivider[UART_PORTS];
+uint8_t     tlmCount[UART_PORTS];
+uint8_t     tlmSeq[UART_PORTS];
+uint8_t     tlmWaiting;
+Encoding    encoding[UART_PORTS];
+
+
+/**
+ * Load a CRC protected block from EEPROM.
+ *
+ * \param  data  destination, the last 2 bytes receive the CRC
+ * \param  addr  EEPROM address
+ * \param  len   length of block including CRC
+ * \return false if the CRC doesn't match
+ */
+bool LoadConfigBlock(void *data, uint16_t addr, uint16_t len)
+{
+  unsigned crc = 0xffff;
+  for (uint16_t i=0; i<len; i++) {
+    ((char*)data)[i] = eeprom_read_byte((void*)(addr+i));
+    crc = _crc_ccitt_update(crc, ((char*)data)[i]);
+  }
+  return crc == 0;
+}
+
+
+/**
+ * Set the CRC of a block before it is saved.
+ *
+ * \param  data  block, the last 2 bytes are set to the CRC
+ * \param  len   length of block including CRC
+ * \return true if the CRC changed
+ */
+bool SealConfigBlock(void *data, uint16_t len)
+{
+  unsigned crc = 0xffff;
+  for (uint16_t i=0; i<len-2; i++)
+    crc = _crc_ccitt_update(crc, ((char*)data)[i]);
+
+  bool changed = ((uint8_t*)data)[len-2] != (uint8_t)crc ||
+                 ((uint8_t*)data)[len-1] != (uint8_t)(crc >> 8);
+  ((char*)data)[len-2] = crc;
+  ((char*)data)[len-1] = crc >> 8;
+  return changed;
+}
+
+
+/**
+ * Set the CRCs of all config blocks.
+ *
+ * \return true if a block changed since the last call
+ */
+bool SealConfig()
+{
+  bool changed = SealConfigBlock(&configArea, sizeof(configArea));
+  changed |= SealConfigBlock(&calibArea, sizeof(calibArea));
+  changed |= SealConfigBlock(&balanceArea, sizeof(balanceArea));
+  return changed;
+}
+
+
+/**
+ * Get the RAM copy of a config byte.
+ *
+ * \param  addr  EEPROM address, BALANCE_ADDR..CONFIG_END-1
+ */
+char *ConfigByte(uint16_t addr)
+{
+  if (addr >= CONFIG_ADDR)
+    return (char*)&configArea + (addr - CONFIG_ADDR);
+  if (addr >= CALIB_ADDR)
+    return (char*)&calibArea + (addr - CALIB_ADDR);
+  return (char*)&balanceArea + (addr - BALANCE_ADDR);
+}
+
+
+/**
+ * Start saving all config blocks to EEPROM.
+ * The blocks are written by PollConfig().
+ *
+ */
+void SaveConfig()
+{
+  SealConfig();
+  saveAddr = BALANCE_ADDR;
+}
+
+
+/**
+ * Write the config blocks to the EEPROM in the background.
+ * Call from the main loop. Like BLK_Poll(), it never waits
+ * for the EEPROM and starts at most one write per call.
+ * Bytes that already have the right value are skipped, so
+ * only changed parts take time.
+ *
+ */
+void PollConfig()
+{
+  while (saveAddr && eeprom_is_ready()) {
+    if (saveAddr == CONFIG_END) {
+      // A block changed while it was written doesn't
+      // match its CRC, go over all of them again.
+      //
+      saveAddr = SealConfig() ? BALANCE_ADDR : 0;
+      continue;
+    }
+
+    uint16_t addr = saveAddr++;
+    uint8_t  data = *ConfigByte(addr);
+    if (eeprom_read_byte((uint8_t*)addr) != data) {
+      eeprom_write_byte((uint8_t*)addr, data);
+      break;
+    }
+  }
+}
 
 
 void InitMCU()
@@ -105,30 +360,32 @@ void InitMCU()
 
   MCUCSR = 0;
   ADC_Init();
+  ATT_Init();
   SRV_Init();
 
-  // Set up zombie timeout
-  //
-  TCCR3B = _BV(CS32) | _BV(CS30) | _BV(WGM32);
-  OCR3A  = (ZOMBIE_TIMEOUT * (F_CPU/1024)) / 1000;
-
   // Initialize serial ports
   //
-  UART_Init(UART_DIVIDER_U2X(115200));
-  fdevopen(UART_PutChar, UART_GetChar, 0);
+  for (uint8_t port=0; port<UART_PORTS; port++)
+    UART_Init(port, UART_DIVIDER_U2X(DEFAULT_BAUD));
+  fdevopen(UART_StdioPut, UART_StdioGet, 0);
 
-  // Load configArea from EEPROM
+  // Load configArea and calibArea from EEPROM
   //
-  unsigned crc = 0xffff;
-  for (int i=4096-sizeof(configArea); i<4096; i++) {
-    ((char*)&configArea)[i] = eeprom_read_byte((void*)i);
-    crc = _crc_ccitt_update(crc, ((char*)&configArea)[i]);
-  }
-  if (crc != 0) {
+  if (!LoadConfigBlock(&configArea, CONFIG_ADDR, sizeof(configArea))) {
     // loading failed, fill with default values.
     //
     memset(&configArea, 0, sizeof(configArea));
   }
+  if (configArea.frameRate < SRV_MIN_RATE || configArea.frameRate > SRV_MAX_RATE)
+    configArea.frameRate = SRV_DEFAULT_RATE;
+  SRV_SetFrameRate(configArea.frameRate);
+  if (!LoadConfigBlock(&calibArea, CALIB_ADDR, sizeof(calibArea)))
+    SRV_DefaultCalibration(calibArea.servo);
+  SRV_SetCalibration(calibArea.servo);
+  if (!LoadConfigBlock(&balanceArea, BALANCE_ADDR, sizeof(balanceArea))) {
+    memset(&balanceArea, BAL_UNUSED, sizeof(balanceArea));
+    balanceArea.limit = BAL_DEFAULT_LIMIT;
+  }
 
   RTTTL_Play_P(PSTR(":d=16,b=160:c,c6."));
 
@@ -142,25 +399,108 @@ void InitMCU()
 
 
 /**
- * Dispatch command and send response data.
+ * Send a sample, raw or delta encoded
+ * as selected for the port.
  *
+ * \param  port    serial port
+ * \param  d       delta stream of the port
+ * \param  values  sample to send
+ * \param  count   values per sample
  */
-void Dispatch(char *data, uint16_t length)
+void SendSample(uint8_t port, PKT_Delta *d, const unsigned *values, uint8_t count)
 {
-  if (length < 2) {
-    PKT_SendByte(0);
-    PKT_SendByte(0);
-    PKT_SendByte(ERR_DATA_LENGTH);
-    PKT_EndPacket();
-    return;
+  if (encoding[port].enabled)
+    PKT_SendDelta(d, values);
+  else
+    PKT_SendBlock(values, count * sizeof(unsigned));
+}
+
+
+/**
+ * Check if delta encoded telemetry would be too fast to
+ * be acknowledged in time, see DELTA_ACK_MS.
+ *
+ * \param  delta     delta encoding enabled
+ * \param  channels  telemetry channels
+ * \param  divider   telemetry rate divider
+ * \param  rate      servo frame rate
+ */
+bool TelemetryTooFast(bool delta, uint8_t channels, uint8_t divider, uint16_t rate)
+{
+  if (!delta || !(channels & (TLM_SENSORS | TLM_SERVOS)))
+    return false;
+  return (uint32_t)divider * 1000 * PKT_DELTA_HISTORY < (uint32_t)DELTA_ACK_MS * rate;
+}
+
+
+/**
+ * Output new target positions with the next frame.
+ * Direct writes override any keyframe motion.
+ *
+ */
+void UpdateServos()
+{
+  MOT_Stop();
+  SRV_SetPositions(targetPositions);
+}
+
+
+/**
+ * Compute gyro balance feedback for the next frame.
+ *
+ * \return true, if the servo feedback offsets were
+ *         updated and the targets must be output again
+ */
+bool UpdateBalance()
+{
+  int16_t  offsets[24];
+  bool     active = false;
+  int16_t  limit  = balanceArea.limit & 0x7fff;
+
+  ATT_State state;
+  ATT_GetState(&state);
+  int16_t input[3] = { state.filtered, state.pitch, state.roll };
+
+  // The attitude estimate is frozen while the ADC is
+  // capturing, suspend the feedback until it resumes.
+  //
+  uint8_t capture = ADC_CaptureState(NULL);
+  bool    suspend = capture == ADC_CAPTURE_ARMED || capture == ADC_CAPTURE_TRIGGERED;
+
+  memset(offsets, 0, sizeof(offsets));
+  for (uint8_t i=0; i<BAL_ENTRIES && !suspend; i++) {
+    BalanceEntry *e = &balanceArea.entry[i];
+    if (e->servo >= 24 || e->source > BAL_ROLL)
+      continue;
+
+    int32_t o = offsets[e->servo] + (((int32_t)input[e->source] * e->gain) >> 8);
+    if (o >  limit)  o =  limit;
+    if (o < -limit)  o = -limit;
+    offsets[e->servo] = o;
+    active = true;
   }
-  
-  int seqnum  = data[0];
-  int command = data[1];
-  PKT_SendByte(seqnum);
-  PKT_SendByte(command);
 
-  data += 2; length -= 2;
+  // Clear the offsets once after the last entry is removed
+  //
+  if (!active && !balanceActive)
+    return false;
+  balanceActive = active;
+  SRV_SetFeedback(offsets);
+  return true;
+}
+
+
+/**
+ * Execute a command and send the error
+ * code and response data.
+ *
+ * \param  port     serial port the command came from
+ * \param  command  command code
+ * \param  data     command parameters
+ * \param  length   length of command parameters
+ */
+void Execute(uint8_t port, uint8_t command, char *data, uint16_t length)
+{
   switch (command) {
     case CMD_NOP: {
       PKT_SendByte(ERR_OK);
@@ -174,14 +514,6 @@ void Dispatch(char *data, uint16_t length)
       break;
     }
 
-    case CMD_READ_SERVOS: {
-      PKT_SendByte(ERR_OK);
-      unsigned tmp[24];
-      SRV_GetPositions(tmp);
-      PKT_SendBlock(tmp, sizeof(tmp));
-      break;
-    }
-
     case CMD_WRITE_SERVOS: {
       if (length < sizeof(targetPositions)) {
         PKT_SendByte(ERR_DATA_LENGTH);
@@ -194,64 +526,149 @@ void Dispatch(char *data, uint16_t length)
 
       PKT_SendByte(ERR_OK);
       memcpy(targetPositions, data, sizeof(targetPositions));
-      SRV_SetPositions(targetPositions);
+      UpdateServos();
+      break;
+    }
+
+    case CMD_UPDATE_SERVOS: {
+      if (length < 4) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      uint8_t  mode = data[0];
+      uint32_t mask = *(uint32_t*)&data[0] >> 8;
 
-      // reset zombie timeout
+      uint8_t  count = 0;
+      for (uint32_t m = mask; m; m >>= 1)
+        count += m & 1;
+
+      if (mode > UPDATE_DELTA) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      if (length < 4 + (mode == UPDATE_ABSOLUTE ? 2*count : count)) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      if (batteryLow) {
+        PKT_SendByte(ERR_BATTERY_LOW);
+        break;
+      }
+
+      // Merge the selected channels, leave the others alone.
+      // Deltas don't switch on unused (zero) channels, and
+      // don't switch off used ones.
       //
-      TCNT3         = 0;
-      zombieUpdates = 0;
+      PKT_SendByte(ERR_OK);
+      char *src = &data[4];
+      for (uint8_t i=0; i<24; i++, mask >>= 1) {
+        if (!(mask & 1))
+          continue;
+        if (mode == UPDATE_ABSOLUTE) {
+          targetPositions[i] = *(uint16_t*)src;
+          src += 2;
+        }
+        else {
+          int32_t pos = (int32_t)targetPositions[i] + (int8_t)*src++;
+          if (targetPositions[i])
+            targetPositions[i] = pos < 1 ? 1 : pos > 0xffff ? 0xffff : pos;
+        }
+      }
+      UpdateServos();
       break;
     }
 
-    case CMD_READ_SENSORS: {
-      if (length < 1) {
+    case CMD_ADD_KEYFRAME: {
+      if (length < 3 + sizeof(targetPositions)) {
         PKT_SendByte(ERR_DATA_LENGTH);
         break;
       }
+      if (batteryLow) {
+        PKT_SendByte(ERR_BATTERY_LOW);
+        break;
+      }
+      if (!MOT_AddKeyframe((unsigned*)&data[3], *(uint16_t*)&data[0], data[2])) {
+        PKT_SendByte(ERR_QUEUE_FULL);
+        break;
+      }
       PKT_SendByte(ERR_OK);
+      PKT_SendByte(MOT_QueueFree());
+      break;
+    }
 
-      // Set accelerometer sensitivity
-      //
-      uint8_t tmp = GSEL_PORT & ~(_BV(GSEL_GS1_BIT) | _BV(GSEL_GS2_BIT));
-      if (data[0] & 1)  tmp |= _BV(GSEL_GS1_BIT);
-      if (data[0] & 2)  tmp |= _BV(GSEL_GS2_BIT);
-      GSEL_PORT = tmp;
+    case CMD_STOP_MOTION: {
+      PKT_SendByte(ERR_OK);
+      MOT_Stop();
+      break;
+    }
 
-      // Read gyroscope in differential mode
-      //
-      ADMUX = _BV(REFS0) | 0x10;        // 1x (ADC0 - ADC1)
-      ADC_Read();                       // throw away first conversion
-      PKT_SendUInt16(ADC_Read());
+    case CMD_WRITE_SEQUENCE: {
+      if (length < 3 + MOT_SEQ_NAME_LEN) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      if (!MOT_WriteSequence(data[0], &data[3], data[1], data[2])) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      break;
+    }
 
-      ADMUX = _BV(REFS0) | 0x09;        // 10x (ADC1 - ADC0)
-      ADC_Read();                       // throw away first conversion
-      PKT_SendUInt16(ADC_Read());
+    case CMD_WRITE_SEQFRAME: {
+      if (length < 1 + MOT_KEYFRAME_SIZE) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      if (!MOT_WriteSeqFrame(data[0], &data[1])) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      break;
+    }
 
-      // Read accelerometer and battery voltage
-      //
-      ADMUX = _BV(REFS0);               // single ended, AVcc
-      ADC_Read();                       // throw away first conversion
-      for (int i=2; i<6; i++) {
-        ADMUX = _BV(REFS0) | i;
-        PKT_SendUInt16(ADC_Read());
+    case CMD_PLAY_SEQUENCE: {
+      if (length < 2) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      if (batteryLow) {
+        PKT_SendByte(ERR_BATTERY_LOW);
+        break;
       }
 
-      // Read PSD Sensors against 2.56V bandgap
+      // Name doesn't need to be zero padded
       //
-      ADMUX = _BV(REFS0) | _BV(REFS1);  // 2.56V bandgap
-      ADC_Read();                       // throw away first conversion
+      char name[MOT_SEQ_NAME_LEN];
+      memset(name, 0, sizeof(name));
+      memcpy(name, &data[1], length-1 < sizeof(name) ? length-1 : sizeof(name));
+
+      if (!MOT_PlaySequence(name, data[0])) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      break;
+    }
 
-      ADMUX = _BV(REFS0) | _BV(REFS1) | 6;
-      PKT_SendUInt16(ADC_Read());
-      ADMUX = _BV(REFS0) | _BV(REFS1) | 7;
-      PKT_SendUInt16(ADC_Read());
+    case CMD_READ_SENSORS: {
+      if (length < 1) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
 
-      // Read CPU voltage
+      // Set accelerometer sensitivity
       //
-      ADMUX = _BV(REFS0) | 0x1E;        // 1.23V bandgap against AVcc
-      ADC_Read();
-      PKT_SendUInt16(ADC_Read());
+      uint8_t tmp = GSEL_PORT & ~(_BV(GSEL_GS1_BIT) | _BV(GSEL_GS2_BIT));
+      if (data[0] & 1)  tmp |= _BV(GSEL_GS1_BIT);
+      if (data[0] & 2)  tmp |= _BV(GSEL_GS2_BIT);
+      GSEL_PORT = tmp;
 
+      unsigned values[ADC_CHANNELS];
+      ADC_GetFiltered(values);
+      SendSample(port, &encoding[port].sensors, values, ADC_CHANNELS);
       break;
     }
 
@@ -260,11 +677,16 @@ void Dispatch(char *data, uint16_t length)
       PKT_SendUInt16(PROTOCOL_VERSION);
       PKT_SendUInt32(F_CPU);
       
-      // Read 1.23V bandgap voltage reference against AVcc
+      // 1.23V bandgap voltage reference against AVcc
+      //
+      PKT_SendUInt16(ADC_Read(ADC_BANDGAP));
+
+      // Command window: number of packets the host may
+      // have in flight. The slots are shared by both ports,
+      // and a packet being received holds one, so only the
+      // slots left over by the other reception are safe.
       //
-      ADMUX = _BV(REFS0) | 0x1E;
-      ADC_Read();
-      PKT_SendUInt16(ADC_Read());
+      PKT_SendByte(PKT_RX_SLOTS - UART_PORTS);
       break;
     }
 
@@ -297,13 +719,13 @@ void Dispatch(char *data, uint16_t length)
     }
 
     case CMD_WRITE_CONFIG: {
-      configArea.crc = 0xffff;
-      for (int i=0; i<sizeof(configArea)-2; i++)
-        configArea.crc = _crc_ccitt_update(configArea.crc, ((char*)&configArea)[i]);
-      for (int i=4096-sizeof(configArea); i<4096; i++) {
-        eeprom_write_byte((void*)i, ((char*)&configArea)[i]);
-        wdt_reset();
-      }
+      // Written in the background, only changed bytes
+      // take time. A reset before it's done loses the
+      // blocks still being written, their CRC fails.
+      //
+      PKT_SendByte(ERR_OK);
+      SaveConfig();
+      break;
     }
 
     case CMD_SET_MIN_BATT: {
@@ -314,48 +736,727 @@ void Dispatch(char *data, uint16_t length)
 
       PKT_SendByte(ERR_OK);
       configArea.minBattery = *(uint16_t*)&data[0];
+      break;
     }
 
-    default:
-      PKT_SendByte(ERR_UNKNOWN_CMD);
+    case CMD_SET_FRAME_RATE: {
+      if (length < 2) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      uint16_t rate = *(uint16_t*)&data[0];
+      bool ok = rate >= SRV_MIN_RATE && rate <= SRV_MAX_RATE;
+      for (uint8_t i=0; i<UART_PORTS; i++)
+        ok = ok && !TelemetryTooFast(encoding[i].enabled, tlmChannels[i], tlmDivider[i], rate);
+      if (!ok) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      configArea.frameRate = rate;
+      SRV_SetFrameRate(rate);
       break;
-  }
+    }
 
-  PKT_EndPacket();
-}
+    case CMD_SET_BAUD: {
+      if (length < 4) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      // Only rates with an exact U2X divider at 16MHz,
+      // plus the default rate for switching back. The servo
+      // output interrupt holds waiting characters for at
+      // most ~26us, ISR_MAX_HOLD plus one edge. The receive
+      // FIFO covers that down to 20us per character (500k),
+      // 1Mbaud would still overrun it.
+      //
+      uint32_t baud = *(uint32_t*)&data[0];
+      if (baud != DEFAULT_BAUD && baud != 250000 && baud != 500000) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      baudDivider[port] = UART_DIVIDER_U2X(baud);
+      baudState[port]   = BAUD_SWITCH;
+      break;
+    }
 
+    case CMD_SUBSCRIBE: {
+      if (length < 2) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      uint8_t channels = data[0] & (TLM_SENSORS | TLM_SERVOS | TLM_BATTERY);
+      uint8_t divider  = data[1];
 
-int main()
-{
-  InitMCU();
+      // No channels unsubscribes, the divider is ignored then
+      //
+      if (!channels) {
+        PKT_SendByte(ERR_OK);
+        tlmChannels[port] = 0;
+        break;
+      }
+      if (divider == 0 || ((channels & TLM_SERVOS) && divider < TLM_SERVO_DIVIDER) ||
+          TelemetryTooFast(encoding[port].enabled, channels, divider, configArea.frameRate)) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      tlmChannels[port] = channels;
+      tlmDivider[port]  = divider;
+      tlmCount[port]    = divider;
+      break;
+    }
+
+    case CMD_SET_ENCODING: {
+      if (length < 2) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      uint8_t mode = data[0], interval = data[1];
+      if (mode > ENC_DELTA || interval == 0 ||
+          TelemetryTooFast(mode == ENC_DELTA, tlmChannels[port], tlmDivider[port], configArea.frameRate)) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+
+      // Also restarts both streams with a keyframe
+      //
+      Encoding *e = &encoding[port];
+      e->enabled = mode == ENC_DELTA;
+      PKT_InitDelta(&e->sensors, e->sensorRef, e->sensorSent[0], ADC_CHANNELS, interval);
+      PKT_InitDelta(&e->servos,  e->servoRef,  e->servoSent[0],  24, interval);
+      break;
+    }
+
+    case CMD_SET_FILTER: {
+      if (length < 4) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      // [channel][oversample][filter][shift], channel
+      // 0xFF configures all channels. All of them are
+      // checked first, so a rejected command changes none.
+      //
+      uint8_t first = data[0], last = data[0];
+      if (data[0] == 0xFF) {
+        first = 0;
+        last  = ADC_CHANNELS - 1;
+      }
+      bool ok = true;
+      for (uint8_t i=first; ok && i<=last; i++)
+        ok = ADC_CheckFilter(i, data[1], data[2], data[3]);
+      if (!ok) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      for (uint8_t i=first; i<=last; i++)
+        ADC_SetFilter(i, data[1], data[2], data[3]);
+
+      PKT_SendByte(ERR_OK);
+      break;
+    }
+
+    case CMD_READ_ATTITUDE: {
+      ATT_State state;
+      ATT_GetState(&state);
+
+      PKT_SendByte(ERR_OK);
+      PKT_SendUInt16(state.pitch);
+      PKT_SendUInt16(state.roll);
+      PKT_SendUInt16(state.rate);
+      PKT_SendUInt16(state.bias);
+      PKT_SendByte(state.rest);
+      break;
+    }
+
+    case CMD_SET_ATTITUDE: {
+      if (length < sizeof(ATT_Config)) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      if (!ATT_SetConfig((ATT_Config*)data)) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      break;
+    }
+
+    case CMD_ACK_SAMPLE: {
+      if (length < 2) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      if (data[0] > STREAM_SERVOS) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      Encoding *e = &encoding[port];
+      PKT_AckDelta(data[0] == STREAM_SERVOS ? &e->servos : &e->sensors, data[1]);
+      break;
+    }
+
+    // Bulk EEPROM write. All three commands answer with
+    // the offset of the next chunk expected and the free
+    // buffer space, so the host can pace and resume.
+    //
+    case CMD_BULK_BEGIN:
+    case CMD_BULK_DATA:
+    case CMD_BULK_END: {
+      int8_t err;
+      if (command == CMD_BULK_BEGIN) {
+        if (length < 6) {
+          PKT_SendByte(ERR_DATA_LENGTH);
+          break;
+        }
+        err = BLK_Begin(*(uint16_t*)&data[0], *(uint16_t*)&data[2], *(uint16_t*)&data[4]);
+      }
+      else if (command == CMD_BULK_DATA) {
+        if (length < 2) {
+          PKT_SendByte(ERR_DATA_LENGTH);
+          break;
+        }
+        err = BLK_Write(*(uint16_t*)&data[0], &data[2], length - 2);
+      }
+      else
+        err = BLK_End();
+
+      PKT_SendByte(err);
+      PKT_SendUInt16(BLK_Offset());
+      PKT_SendByte(BLK_Free());
+      break;
+    }
+
+    case CMD_READ_CALIB: {
+      if (length < 2) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      uint8_t first = data[0], count = data[1];
+      if (first + count > 24) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      PKT_SendBlock(&calibArea.servo[first], count * sizeof(ServoCalib));
+      break;
+    }
+
+    case CMD_WRITE_CALIB: {
+      // First channel, followed by any number of entries.
+      // The table is applied at once, use CMD_WRITE_CONFIG
+      // to make it permanent.
+      //
+      if (length < 1) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      uint8_t first = data[0];
+      uint8_t count = (length-1) / sizeof(ServoCalib);
+      if (first + count > 24) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      memcpy(&calibArea.servo[first], &data[1], count * sizeof(ServoCalib));
+      SRV_SetCalibration(calibArea.servo);
+      break;
+    }
+
+    case CMD_READ_BALANCE: {
+      PKT_SendByte(ERR_OK);
+      PKT_SendBlock(&balanceArea, sizeof(balanceArea) - 2);
+      break;
+    }
+
+    case CMD_WRITE_BALANCE: {
+      // Whole table without CRC. It is applied with the
+      // next frame, use CMD_WRITE_CONFIG to make it permanent.
+      //
+      if (length < sizeof(balanceArea) - 2) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      BalanceEntry *e = (BalanceEntry*)data;
+      bool ok = true;
+      for (uint8_t i=0; i<BAL_ENTRIES; i++) {
+        if (e[i].servo != BAL_UNUSED && (e[i].servo >= 24 || e[i].source > BAL_ROLL))
+          ok = false;
+      }
+      if (!ok) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      memcpy(&balanceArea, data, sizeof(balanceArea) - 2);
+      break;
+    }
+
+    case CMD_START_CAPTURE: {
+      if (length < sizeof(ADC_Capture)) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      if (!ADC_StartCapture((ADC_Capture*)data)) {
+        PKT_SendByte(ERR_RANGE);
+        break;
+      }
+      PKT_SendByte(ERR_OK);
+      break;
+    }
+
+    case CMD_STOP_CAPTURE: {
+      PKT_SendByte(ERR_OK);
+      ADC_StopCapture();
+      break;
+    }
+
+    case CMD_READ_CAPTURE: {
+      // [offset][count], returns state, overruns and
+      // the values once the capture is complete.
+      //
+      if (length < 4) {
+        PKT_SendByte(ERR_DATA_LENGTH);
+        break;
+      }
+      uint16_t offset = *(uint16_t*)&data[0];
+      uint16_t count  = *(uint16_t*)&data[2];
+      uint8_t  overruns;
+
+      PKT_SendByte(ERR_OK);
+      PKT_SendByte(ADC_CaptureState(&overruns));
+      PKT_SendByte(overruns);
+
+      unsigned values[16];
+      while (count) {
+        uint16_t n = ADC_ReadCapture(offset, values, count < 16 ? count : 16);
+        if (!n)
+          break;
+        PKT_SendBlock(values, n * sizeof(unsigned));
+        offset += n;
+        count  -= n;
+      }
+      break;
+    }
+
+    case CMD_READ_STATS: {
+      PKT_SendByte(ERR_OK);
+      SRV_Stats stats;
+      SRV_GetStats(&stats);
+      PKT_SendUInt16(stats.frames);
+      PKT_SendUInt16(stats.frameTicks);
+      PKT_SendUInt16(stats.isrTicks);
+      PKT_SendUInt16(stats.builds);
+      PKT_SendUInt16(stats.buildTicks);
+      PKT_SendUInt16(stats.lateEdges);
+
+      // Main loop iterations since the last call. The loop
+      // keeps running during servo frames, so this is a
+      // direct measure of the CPU time left for the host.
+      //
+      PKT_SendUInt16(mainLoops);
+      mainLoops = 0;
+
+      // Receive overruns by port since the last call
+      //
+      for (uint8_t i=0; i<UART_PORTS; i++)
+        PKT_SendByte(UART_Overruns(i));
+
+      // Sensor scans restarted after a lost ADC interrupt,
+      // since reset. Should stay 0.
+      //
+      PKT_SendByte(adcRestarts);
+
+      // Stack bytes never used since reset
+      //
+      PKT_SendUInt16(stackmargin());
+      break;
+    }
+
+    case CMD_BENCH_UART: {
+      // Send 32 filler bytes through the byte-wise path
+      // and 32 through the block path, and report the CPU
+      // ticks for each. Queued packets are sent first so
+      // waiting for the wire isn't counted. Interrupts
+      // stay on, so take the minimum of a few runs.
+      //
+      uint8_t fill[32];
+      memset(fill, 0x55, sizeof(fill));
+      PKT_SendByte(ERR_OK);
+      PKT_Flush(port);
+
+      uint16_t t0 = TCNT1;
+      for (uint8_t i=0; i<sizeof(fill); i++)
+        PKT_SendByte(fill[i]);
+      uint16_t t1 = TCNT1;
+      PKT_SendBlock(fill, sizeof(fill));
+      uint16_t t2 = TCNT1;
+
+      PKT_SendUInt16(t1 - t0);
+      PKT_SendUInt16(t2 - t1);
+      break;
+    }
+
+    case CMD_READ_JITTER: {
+      PKT_SendByte(ERR_OK);
+      uint8_t tmp[24];
+      SRV_GetJitter(tmp);
+      PKT_SendBlock(tmp, sizeof(tmp));
+      break;
+    }
+
+    default:
+      PKT_SendByte(ERR_UNKNOWN_CMD);
+      break;
+  }
+}
+
+
+/**
+ * Queue a servo readback. Readback takes a whole
+ * frame slot, it is started by the main loop, which
+ * sends the CMD_READ_SERVOS response when it is done.
+ * Requests from both ports are served by one readback.
+ *
+ * \return false if the port has a readback pending
+ *         already, it must be rejected with ERR_QUEUE_FULL
+ */
+bool RequestReadback(uint8_t port, uint8_t seqnum)
+{
+  if (readbackPending & _BV(port))
+    return false;
+
+  readbackSeq[port] = seqnum;
+  readbackPending  |= _BV(port);
+  SRV_HoldFrames(true);
+  return true;
+}
+
+
+/**
+ * Execute the sub-commands of a CMD_BATCH packet in order.
+ * Sub-commands are [length][command][data...], with length
+ * counting command and data. Results are sent as records
+ * [length][command][error][data...] in the same order.
+ *
+ * A CMD_READ_SERVOS sub-command only returns ERR_OK, the
+ * positions follow in a separate CMD_READ_SERVOS response
+ * with the batch's sequence number. ERR_QUEUE_FULL if the
+ * port has a readback pending already.
+ *
+ * CMD_BATCH and CMD_BENCH_UART are rejected with ERR_UNKNOWN_CMD.
+ * The benchmark flushes the port, which can't complete while
+ * part of the open batch response is already released.
+ *
+ * \param  port     serial port the batch came from
+ * \param  seqnum   sequence number of the batch
+ * \param  data     sub-commands
+ * \param  length   length of sub-commands
+ */
+void ExecuteBatch(uint8_t port, uint8_t seqnum, char *data, uint16_t length)
+{
+  // Check the framing before executing anything
+  //
+  for (uint16_t pos=0; pos<length; pos += 1 + (uint8_t)data[pos]) {
+    uint8_t len = data[pos];
+    if (len < 1 || pos + 1 + len > length) {
+      PKT_SendByte(ERR_DATA_LENGTH);
+      return;
+    }
+  }
+  PKT_SendByte(ERR_OK);
+
+  for (uint16_t pos=0; pos<length; pos += 1 + (uint8_t)data[pos]) {
+    uint8_t len     = data[pos];
+    uint8_t command = data[pos+1];
+
+    PKT_BeginRecord();
+    PKT_SendByte(command);
+    if (command == CMD_READ_SERVOS)
+      PKT_SendByte(RequestReadback(port, seqnum) ? ERR_OK : ERR_QUEUE_FULL);
+    else if (command == CMD_BATCH || command == CMD_BENCH_UART)
+      PKT_SendByte(ERR_UNKNOWN_CMD);
+    else
+      Execute(port, command, &data[pos+2], len-1);
+
+    if (!PKT_EndRecord()) {
+      PKT_BeginRecord();
+      PKT_SendByte(command);
+      PKT_SendByte(ERR_OVERFLOW);
+      PKT_EndRecord();
+    }
+  }
+}
+
+
+/**
+ * Dispatch command and send response data.
+ *
+ * \param  port    serial port the command came from
+ * \param  data    command packet
+ * \param  length  length of command packet
+ */
+void Dispatch(uint8_t port, char *data, uint16_t length)
+{
+  if (length < 2) {
+    PKT_BeginPacket(port);
+    PKT_SendByte(0);
+    PKT_SendByte(0);
+    PKT_SendByte(ERR_DATA_LENGTH);
+    PKT_EndPacket();
+    return;
+  }
+  
+  uint8_t seqnum  = data[0];
+  uint8_t command = data[1];
+
+  // A second readback from the same port would replace the
+  // sequence number of the first, so it's rejected until
+  // the first is answered.
+  //
+  if (command == CMD_READ_SERVOS) {
+    if (!RequestReadback(port, seqnum)) {
+      PKT_BeginPacket(port);
+      PKT_SendByte(seqnum);
+      PKT_SendByte(command);
+      PKT_SendByte(ERR_QUEUE_FULL);
+      PKT_EndPacket();
+    }
+    return;
+  }
+
+  PKT_BeginPacket(port);
+  PKT_SendByte(seqnum);
+  PKT_SendByte(command);
+
+  if (command == CMD_BATCH)
+    ExecuteBatch(port, seqnum, data+2, length-2);
+  else
+    Execute(port, command, data+2, length-2);
+
+  PKT_EndPacket();
+}
+
+
+/**
+ * Advance the baud rate handshake of a port.
+ * Called after each packet and on every frame tick.
+ * Only frame ticks count down the confirmation
+ * timeout, however many packets are dispatched.
+ *
+ * \param  port      serial port
+ * \param  received  a valid packet was received
+ * \param  tick      called on a frame tick
+ */
+void UpdateBaud(uint8_t port, bool received, bool tick)
+{
+  switch (baudState[port]) {
+    case BAUD_SWITCH:
+      // The OK response goes out at the old rate
+      //
+      PKT_Flush(port);
+      UART_SetBaud(port, baudDivider[port]);
+      PKT_MarkReceived(port);
+      baudTimeout[port] = (uint32_t)configArea.frameRate * BAUD_CONFIRM_MS / 1000;
+      baudState[port]   = BAUD_CONFIRM;
+      break;
 
-  PKT_BeginReceive(packet, sizeof(packet));
+    case BAUD_CONFIRM:
+      if (received)
+        baudState[port] = BAUD_FIXED;
+      else if (tick && !--baudTimeout[port]) {
+        UART_SetBaud(port, UART_DIVIDER_U2X(DEFAULT_BAUD));
+        baudState[port] = BAUD_FIXED;
+      }
+      break;
+  }
+}
+
+
+/**
+ * Send a telemetry packet. The sequence number
+ * field carries the port's telemetry counter.
+ *
+ * \param  port       serial port
+ * \param  positions  servo readback, if subscribed
+ */
+void SendTelemetry(uint8_t port, unsigned *positions)
+{
+  uint8_t channels = tlmChannels[port];
+
+  PKT_BeginPacket(port);
+  PKT_SendByte(tlmSeq[port]++);
+  PKT_SendByte(CMD_TELEMETRY);
+  PKT_SendByte(ERR_OK);
+  PKT_SendUInt32(frameTime / MOT_TICKS_MS);
+  PKT_SendByte(channels);
+
+  if (channels & TLM_SENSORS) {
+    unsigned values[ADC_CHANNELS];
+    ADC_GetFiltered(values);
+    SendSample(port, &encoding[port].sensors, values, ADC_CHANNELS);
+  }
+  if (channels & TLM_SERVOS)
+    SendSample(port, &encoding[port].servos, positions, 24);
+  if (channels & TLM_BATTERY) {
+    PKT_SendUInt16(ADC_Read(ADC_BATTERY));
+  }
+  PKT_EndPacket();
+}
+
+
+/**
+ * Count down the telemetry rate dividers. Called on
+ * every frame tick. Telemetry with servo readback
+ * waits for the next frame slot, see PollReadback().
+ *
+ */
+void UpdateTelemetry()
+{
+  for (uint8_t port=0; port<UART_PORTS; port++) {
+    if (!tlmChannels[port] || --tlmCount[port])
+      continue;
+
+    tlmCount[port] = tlmDivider[port];
+    if (tlmChannels[port] & TLM_SERVOS) {
+      tlmWaiting |= _BV(port);
+      SRV_HoldFrames(true);
+    }
+    else
+      SendTelemetry(port, 0);
+  }
+}
+
+
+/**
+ * Send the deferred CMD_READ_SERVOS responses and
+ * telemetry packets to all requesting ports, once
+ * the readback is complete. Called from the main loop.
+ *
+ */
+void PollReadback()
+{
+  unsigned tmp[24];
+  if (!SRV_PollReadback(tmp))
+    return;
+
+  // A port may have unsubscribed while it waited
+  //
+  for (uint8_t port=0; port<UART_PORTS; port++) {
+    if ((tlmWaiting & _BV(port)) && tlmChannels[port])
+      SendTelemetry(port, tmp);
+  }
+
+  for (uint8_t port=0; port<UART_PORTS; port++) {
+    if (readbackPending & _BV(port)) {
+      PKT_BeginPacket(port);
+      PKT_SendByte(readbackSeq[port]);
+      PKT_SendByte(CMD_READ_SERVOS);
+      PKT_SendByte(ERR_OK);
+      SendSample(port, &encoding[port].servos, tmp, 24);
+      PKT_EndPacket();
+    }
+  }
+  readbackPending = 0;
+  tlmWaiting      = 0;
+  SRV_HoldFrames(false);
+}
+
+
+int main()
+{
+  uint8_t lastScan = 0;
+
+  InitMCU();
+
+  for (uint8_t port=0; port<UART_PORTS; port++) {
+    PKT_BeginReceive(port);
+    PKT_BeginTransmit(port);
+  }
   for (;;) {
     wdt_reset();
+    mainLoops++;
 
-    // Check battery
+    // Check battery once per ADC scan
     //
-    ADMUX = _BV(REFS0) | 5;
-    batteryLow = ADC_Read() < configArea.minBattery;
+    if (ADC_ScanCount() != lastScan) {
+      lastScan   = ADC_ScanCount();
+      batteryLow = ADC_Read(ADC_BATTERY) < configArea.minBattery;
     
-    if (batteryLow)
-      RTTTL_Play_P(PSTR("::c6"));
+      if (batteryLow)
+        RTTTL_Play_P(PSTR("::c6"));
+    }
 
-    // Receive command packet
+    // Receive command packets. Both ports feed one
+    // queue of PKT_RX_SLOTS packets, responses go
+    // back to the port a command came from.
     //
-    int length = PKT_ReceiveAsync();
+    uint8_t port;
+    char   *packet;
+    int     length = PKT_ReceiveAsync(&port, &packet);
     if (length > 0) {
+      // A valid packet confirms a new baud rate, unless
+      // it was queued at the old rate before the switch
+      //
+      UpdateBaud(port, !PKT_IsMarked(), false);
       LED_PORT &= ~_BV(LED1_BIT);
-      Dispatch(packet, length);
+      Dispatch(port, packet, length);
+      PKT_ReleaseReceive();
       LED_PORT |=  _BV(LED1_BIT);
+      UpdateBaud(port, false, false);
     }
+    else if (length == ERR_QUEUE_FULL || length == ERR_OVERFLOW ||
+             length == ERR_DATA_LENGTH) {
+      // The host sent more than the window, a packet
+      // too long for a slot or an empty one. Reject it
+      // by sequence number, so the host knows what to
+      // resend.
+      //
+      PKT_BeginPacket(port);
+      PKT_SendByte(packet[0]);
+      PKT_SendByte(packet[1]);
+      PKT_SendByte(length);
+      PKT_EndPacket();
+    }
+
+    // Write buffered bulk data and config blocks
+    // to the EEPROM
+    //
+    BLK_Poll();
+    PollConfig();
+
+    // Answer a completed servo readback
+    //
+    PollReadback();
 
-    // Check for zombie timeout
+    // Servo frame tick. Frames are started by the frame
+    // timer, here we prepare the targets for the next one.
+    // A pending readback takes the place of a frame.
     //
-    if ((ETIFR & _BV(OCF3A)) && zombieUpdates < ZOMBIE_MAXUPDATES) {
-      SRV_SetPositions(targetPositions);
-      ETIFR |= _BV(OCF3A);
-      zombieUpdates++;
+    if (SRV_FrameTick()) {
+      uint16_t dt = (1000L * MOT_TICKS_MS) / configArea.frameRate;
+      frameTime += dt;
+
+      for (uint8_t port=0; port<UART_PORTS; port++)
+        UpdateBaud(port, false, true);
+      adcRestarts = ADC_CheckScan();
+
+      // Balance feedback is mixed in by the servo engine,
+      // so the targets are output every frame while active.
+      // Feedback alone doesn't start frames.
+      //
+      bool moved   = MOT_Frame(targetPositions, dt);
+      bool balance = UpdateBalance();
+      if (moved)
+        SRV_SetPositions(targetPositions);
+      else if (balance)
+        SRV_Refresh();
+      if (readbackPending || tlmWaiting)
+        SRV_StartReadback();
+      UpdateTelemetry();
     }
   }
 }
@@ -13,9 +13,16 @@
 // include files -----
 //
 #include "misc.h"
+#include <inttypes.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <avr/pgmspace.h>
+#include <avr/io.h>
+
+#define  STACK_PAINT  0xC5   ///< Fill pattern of unused stack
+
+extern uint8_t   __heap_start;   ///< End of .bss, set by the linker
+extern char     *__brkval;       ///< Top of the malloc() heap, 0 if unused
 
 /**
  * Generates a nice hexdump of a memory area.
@@ -62,3 +69,40 @@ void hexdump(void *mem, unsigned length)
     printf("%s", line);
   }
 }
+
+
+/**
+ * Fill the free RAM between .bss and RAMEND with STACK_PAINT.
+ * Runs from .init3, after the stack pointer is set up and
+ * before .data and .bss are initialized. Naked and without
+ * calls, so it does not touch the stack itself. The volatile
+ * pointer keeps the compiler from turning the loop into a
+ * memset() call, which would paint over its own return address.
+ */
+void paintstack() __attribute__((naked, section(".init3")));
+void paintstack()
+{
+  volatile uint8_t *p = &__heap_start;
+  while (p <= (uint8_t*)RAMEND)
+    *p++ = STACK_PAINT;
+}
+
+
+/**
+ * Measure the stack margin.
+ *
+ * Counts the painted bytes above the heap that were never
+ * overwritten since reset. This is the smallest distance
+ * between the stack and the static data seen so far.
+ *
+ * \return  unused stack in bytes
+ */
+unsigned stackmargin()
+{
+  uint8_t *p = __brkval ? (uint8_t*)__brkval : &__heap_start;
+  unsigned n = 0;
+
+  while (p <= (uint8_t*)RAMEND && *p++ == STACK_PAINT)
+    n++;
+  return n;
+}
@@ -10,6 +10,7 @@
 #ifndef MISC_H
 #define MISC_H
 
-extern void hexdump(void *mem, unsigned length);
+extern void      hexdump(void *mem, unsigned length);
+extern unsigned  stackmargin();
 
 #endif
@@ -0,0 +1,286 @@
+/*  $Id$
+    Copyright (c)2006 by Thomas Kindler, thomas.kindler@gmx.de
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of
+    the License, or (at your option) any later version. Read the
+    full License at http://www.gnu.org/copyleft for more details.
+*/
+
+// include files -----
+//
+#include "motion.h"
+#include <string.h>
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+
+typedef struct {
+  unsigned  positions[24];  ///< Target positions
+  uint16_t  duration;       ///< Time to reach the target in ms
+  uint8_t   profile;        ///< Interpolation profile
+} Keyframe;
+
+/**
+ * Sequence directory entry in EEPROM.
+ */
+typedef struct {
+  char      name[MOT_SEQ_NAME_LEN];  ///< Zero padded name
+  uint8_t   first;                   ///< First keyframe in pool
+  uint8_t   count;                   ///< Number of keyframes
+} SeqEntry;
+
+static Keyframe  queue[MOT_QUEUE_SIZE];
+static uint8_t   queueHead;     ///< Keyframe currently moved to
+static uint8_t   queueCount;    ///< Number of queued keyframes
+static unsigned  from[24];      ///< Positions at start of current keyframe
+static uint32_t  elapsed;       ///< Time into current keyframe (1/MOT_TICKS_MS ms)
+static bool      started;       ///< from[] is valid for the current keyframe
+
+static uint8_t   seqFirst;      ///< First pool keyframe of playing sequence
+static uint8_t   seqCount;      ///< Number of keyframes in sequence
+static uint8_t   seqPos;        ///< Next keyframe to be queued
+static uint8_t   seqRepeat;     ///< Remaining repetitions, 0 = forever
+static bool      seqActive;     ///< Sequence playback running
+
+
+/**
+ * Evaluate interpolation profile.
+ *
+ * \param  profile  MOT_LINEAR or MOT_SMOOTH
+ * \param  u        progress in 1.15 fixed point (0..32768)
+ * \return weight of the target position in 1.15 fixed point
+ */
+static uint16_t MOT_Profile(uint8_t profile, uint16_t u)
+{
+  if (profile == MOT_SMOOTH) {
+    // s = 3u^2 - 2u^3 = u^2 * (3 - 2u)
+    //
+    uint32_t u2 = ((uint32_t)u * u) >> 15;
+    uint32_t t  = 3*32768UL - 2*(uint32_t)u;
+    return (u2 * t) >> 15;
+  }
+  return u;
+}
+
+
+/**
+ * Write a block to EEPROM.
+ * Each byte takes ~8.5ms on the ATmega128, so a whole keyframe
+ * blocks for up to ~430ms. Bytes that already have the right
+ * value are skipped, and the watchdog is kept happy. Use the
+ * bulk transfer commands to write many keyframes.
+ */
+static void MOT_WriteEeprom(uint16_t addr, const void *data, uint8_t len)
+{
+  const uint8_t *src = data;
+  while (len--) {
+    if (eeprom_read_byte((uint8_t*)addr) != *src)
+      eeprom_write_byte((uint8_t*)addr, *src);
+    addr++;
+    src++;
+    wdt_reset();
+  }
+}
+
+
+/**
+ * Load a keyframe from the EEPROM pool.
+ *
+ * \param  k      destination
+ * \param  index  pool index
+ */
+static void MOT_LoadKeyframe(Keyframe *k, uint8_t index)
+{
+  uint16_t addr = MOT_SEQ_POOL + index * MOT_KEYFRAME_SIZE;
+  k->duration = eeprom_read_word((uint16_t*)addr);
+  k->profile  = eeprom_read_byte((uint8_t*)addr + 2);
+  eeprom_read_block(k->positions, (void*)(addr + 3), sizeof(k->positions));
+}
+
+
+/**
+ * Refill the keyframe queue from the playing sequence.
+ */
+static void MOT_FillQueue()
+{
+  while (seqActive && queueCount < MOT_QUEUE_SIZE) {
+    if (seqPos == seqCount) {
+      if (seqRepeat == 1) {
+        seqActive = false;
+        break;
+      }
+      if (seqRepeat)
+        seqRepeat--;
+      seqPos = 0;
+    }
+    MOT_LoadKeyframe(&queue[(queueHead + queueCount) % MOT_QUEUE_SIZE], seqFirst + seqPos);
+    seqPos++;
+    queueCount++;
+  }
+}
+
+
+/**
+ * Queue a keyframe.
+ *
+ * \param  positions  array of 24 servo target positions
+ * \param  duration   time to reach the target in ms
+ * \param  profile    interpolation profile
+ * \return false if the queue is full
+ */
+bool MOT_AddKeyframe(const unsigned *positions, uint16_t duration, uint8_t profile)
+{
+  if (queueCount == MOT_QUEUE_SIZE)
+    return false;
+
+  Keyframe *k = &queue[(queueHead + queueCount) % MOT_QUEUE_SIZE];
+  memcpy(k->positions, positions, sizeof(k->positions));
+  k->duration = duration;
+  k->profile  = profile;
+  queueCount++;
+  return true;
+}
+
+
+/**
+ * Get number of free keyframe slots.
+ */
+uint8_t MOT_QueueFree()
+{
+  return MOT_QUEUE_SIZE - queueCount;
+}
+
+
+/**
+ * Stop motion and drop all queued keyframes.
+ * The servos stay at the last interpolated positions.
+ */
+void MOT_Stop()
+{
+  queueCount = 0;
+  started    = false;
+  seqActive  = false;
+}
+
+
+/**
+ * Advance the trajectory by one servo frame.
+ *
+ * \param  positions  array of 24 positions. Holds the current
+ *                    positions on entry and is updated in place.
+ * \param  dt         time since last frame in 1/MOT_TICKS_MS ms
+ * \return true if positions were changed
+ */
+bool MOT_Frame(unsigned *positions, uint16_t dt)
+{
+  MOT_FillQueue();
+  if (!queueCount)
+    return false;
+
+  Keyframe *k = &queue[queueHead];
+  if (!started) {
+    memcpy(from, positions, sizeof(from));
+    elapsed = 0;
+    started = true;
+  }
+
+  uint32_t duration = (uint32_t)k->duration * MOT_TICKS_MS;
+
+  elapsed += dt;
+  if (elapsed >= duration) {
+    // Target reached. Carry the remaining time over into the
+    // next keyframe, so chained keyframes don't stutter.
+    //
+    memcpy(positions, k->positions, sizeof(k->positions));
+    elapsed -= duration;
+    queueHead = (queueHead + 1) % MOT_QUEUE_SIZE;
+    queueCount--;
+    if (queueCount) 
+      memcpy(from, positions, sizeof(from));
+    else
+      started = false;
+    return true;
+  }
+
+  // u = elapsed/duration in 1.15 fixed point (MOT_TICKS_MS = 2^6)
+  //
+  uint16_t u = (elapsed << 9) / k->duration;
+  int32_t  s = MOT_Profile(k->profile, u);
+
+  for (uint8_t i=0; i<24; i++)
+    positions[i] = from[i] + (((int32_t)k->positions[i] - from[i]) * s >> 15);
+
+  return true;
+}
+
+
+/**
+ * Write a sequence directory entry.
+ *
+ * \param  slot   directory entry
+ * \param  name   sequence name, up to MOT_SEQ_NAME_LEN characters
+ * \param  first  first keyframe in pool
+ * \param  count  number of keyframes, 0 deletes the entry
+ * \return false if the arguments are out of range
+ */
+bool MOT_WriteSequence(uint8_t slot, const char *name, uint8_t first, uint8_t count)
+{
+  if (slot >= MOT_SEQ_COUNT || first + count > MOT_SEQ_FRAMES)
+    return false;
+
+  SeqEntry e;
+  strncpy(e.name, name, sizeof(e.name));
+  e.first = first;
+  e.count = count;
+  MOT_WriteEeprom(MOT_SEQ_DIR + slot * sizeof(SeqEntry), &e, sizeof(e));
+  return true;
+}
+
+
+/**
+ * Write a keyframe to the EEPROM pool.
+ *
+ * \param  index     pool index
+ * \param  keyframe  MOT_KEYFRAME_SIZE bytes: duration, profile, positions
+ * \return false if index is out of range
+ */
+bool MOT_WriteSeqFrame(uint8_t index, const void *keyframe)
+{
+  if (index >= MOT_SEQ_FRAMES)
+    return false;
+
+  MOT_WriteEeprom(MOT_SEQ_POOL + index * MOT_KEYFRAME_SIZE, keyframe, MOT_KEYFRAME_SIZE);
+  return true;
+}
+
+
+/**
+ * Start playback of a stored sequence.
+ * The keyframes are fed into the queue from MOT_Frame().
+ *
+ * \param  name    sequence name
+ * \param  repeat  number of repetitions, 0 = until stopped
+ * \return false if there is no such sequence
+ */
+bool MOT_PlaySequence(const char *name, uint8_t repeat)
+{
+  for (uint8_t slot=0; slot<MOT_SEQ_COUNT; slot++) {
+    SeqEntry e;
+    eeprom_read_block(&e, (void*)(MOT_SEQ_DIR + slot * sizeof(SeqEntry)), sizeof(e));
+
+    if (e.count == 0 || e.count == 0xff || e.first + e.count > MOT_SEQ_FRAMES)
+      continue;
+    if (strncmp(e.name, name, sizeof(e.name)))
+      continue;
+
+    MOT_Stop();
+    seqFirst  = e.first;
+    seqCount  = e.count;
+    seqPos    = 0;
+    seqRepeat = repeat;
+    seqActive = true;
+    return true;
+  }
+  return false;
+}
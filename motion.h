@@ -0,0 +1,43 @@
+/*  $Id$
+    Copyright (c)2006 by Thomas Kindler, thomas.kindler@gmx.de
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of
+    the License, or (at your option) any later version. Read the
+    full License at http://www.gnu.org/copyleft for more details.
+*/
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Interpolation profiles
+//
+#define  MOT_LINEAR      0    ///< Constant velocity
+#define  MOT_SMOOTH      1    ///< Cubic smooth-step, zero velocity at both ends
+
+#define  MOT_QUEUE_SIZE  4    ///< Number of queued keyframes
+#define  MOT_TICKS_MS    64   ///< Time units per ms for MOT_Frame()
+
+// EEPROM sequence store
+//
+#define  MOT_SEQ_COUNT     8        ///< Number of sequence directory entries
+#define  MOT_SEQ_NAME_LEN  8        ///< Maximum length of a sequence name
+#define  MOT_SEQ_FRAMES    64       ///< Size of keyframe pool
+#define  MOT_SEQ_DIR       0x0000   ///< EEPROM address of sequence directory
+#define  MOT_SEQ_POOL      0x0060   ///< EEPROM address of keyframe pool (to 0x0D20)
+
+#define  MOT_KEYFRAME_SIZE (3 + 2*24)  ///< Keyframe size on the wire and in EEPROM
+
+extern bool     MOT_AddKeyframe(const unsigned *positions, uint16_t duration, uint8_t profile);
+extern uint8_t  MOT_QueueFree();
+extern void     MOT_Stop();
+extern bool     MOT_Frame(unsigned *positions, uint16_t dt);
+
+extern bool     MOT_WriteSequence(uint8_t slot, const char *name, uint8_t first, uint8_t count);
+extern bool     MOT_WriteSeqFrame(uint8_t index, const void *keyframe);
+extern bool     MOT_PlaySequence(const char *name, uint8_t repeat);
+
+#endif
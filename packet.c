@@ -15,21 +15,212 @@
 #include <avr/io.h>
 #include <avr/crc16.h>
 #include <avr/wdt.h>
+#include <avr/interrupt.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 #define  PKT_END      0xC0     ///< End-of-packet symbol
 #define  PKT_ESC      0xDB     ///< Escape symbol
 #define  PKT_ESC_END  0xDC     ///< Escaped C0 byte
 #define  PKT_ESC_ESC  0xDD     ///< Escaped DB byte
 
+/**
+ * Receive packet slot.
+ * The slots are shared by all ports.
+ *
+ */
+typedef struct {
+  char        data[PKT_SLOT_SIZE];  ///< Packet data including CRC
+  uint8_t     length;          ///< Length without CRC
+  uint8_t     port;            ///< Port the packet came from
+  bool        marked;          ///< Received before PKT_MarkReceived()
+} RxSlot;
+
+#define  RX_REJECTS   4         ///< Rejections kept per port until reported
+
+/**
+ * Receive state of one serial port.
+ * Only touched by the receive interrupt,
+ * except for the error queue.
+ *
+ */
+typedef struct {
+  int8_t      slot;            ///< Slot being received into, -1 if none
+  uint8_t     pos;             ///< Current position in packet
+  uint16_t    crc;             ///< Running CRC of current packet
+  bool        esc;             ///< Last byte was an escape symbol
+  int8_t      drop;            ///< Error code if the packet is dropped
+  char        header[2];       ///< Sequence number and command
+  bool        marked;          ///< Current packet began before PKT_MarkReceived()
+  int8_t      errors[RX_REJECTS];        ///< Receive errors for the main loop
+  char        errHeaders[RX_REJECTS][2]; ///< Headers of the rejected packets
+  uint8_t     errHead;         ///< First entry of errors
+  volatile uint8_t  errLen;    ///< Number of entries in errors
+} RxState;
+
+/**
+ * Transmit state of one serial port.
+ * Packets are stored unescaped. The transmit interrupt
+ * adds the framing and escaping as it sends them.
+ *
+ */
+typedef struct {
+  uint8_t           buf[PKT_TX_BUFFER_SIZE];  ///< Raw packet data, ring
+  volatile uint8_t  head;      ///< Next byte to send
+  volatile uint8_t  tail;      ///< End of data released for sending
+  uint8_t           ends[PKT_TX_FRAMES];  ///< End positions of complete packets
+  volatile uint8_t  endHead;   ///< Next packet end to reach
+  volatile uint8_t  endTail;   ///< Next free entry in ends[]
+  uint8_t           state;     ///< Transmit interrupt state
+} TxState;
+
+// TxState.state
+//
+#define  TX_IDLE      0        ///< Between packets
+#define  TX_DATA      1        ///< Sending packet data
+#define  TX_ESCAPED   2        ///< Escape sent, escaped byte next
+
+#define  TX_FRAMES_MASK  (PKT_TX_FRAMES - 1)
+#define  TX_BUFFER_MASK  (PKT_TX_BUFFER_SIZE - 1)
+
+#if (PKT_TX_FRAMES & TX_FRAMES_MASK)
+  #error PKT_TX_FRAMES is not a power of 2
+#endif
+
+#if (PKT_TX_BUFFER_SIZE & TX_BUFFER_MASK) || PKT_TX_BUFFER_SIZE > 256
+  #error PKT_TX_BUFFER_SIZE is not a power of 2 up to 256
+#endif
+
+static   uint8_t      txPort;  ///< Port of current packet
 static   uint16_t     txCrc;   ///< CRC checksum of current packet
-static   int          txLen;   ///< Length of current packet
+static   uint8_t      txCrcPos;    ///< CRC computed up to here
+static   uint8_t      txPos;   ///< Write position of current packet
+static   uint8_t      txMark;  ///< Length byte of open record
+static   bool         txHold;  ///< Record open, hold data from txMark
+static   bool         txOverflow;  ///< Open record didn't fit
 
-static   char        *rxBuf;   ///< Pointer to receive buffer
-static   uint16_t     rxBufSize;   ///< Length of receive buffer
-static   uint16_t     rxPos;   ///< Current position in receive buffer
-static   bool         rxEsc;   ///< Last byte was an escape symbol
+static   RxState      rx[UART_PORTS];
+static   RxSlot       rxSlots[PKT_RX_SLOTS];
+static   volatile uint8_t  rxFree = _BV(PKT_RX_SLOTS) - 1;  ///< Bit mask of free slots
+static   uint8_t      rxQueue[PKT_RX_SLOTS];  ///< Complete packets in arrival order
+static   volatile uint8_t  rxQueueHead;       ///< First entry of rxQueue
+static   volatile uint8_t  rxQueueLen;        ///< Number of entries in rxQueue
+static   int8_t       rxCurrent = -1;         ///< Slot owned by the main loop
+static   bool         rxMarked;               ///< Packet of rxCurrent is marked
+static   char         rxRejected[2];          ///< Header of last rejected packet
+static   TxState      tx[UART_PORTS];
+
+
+/**
+ * Get the next character to send.
+ * Called from the UART transmit interrupt.
+ *
+ * \param  port  serial port
+ * \return character, or -1 if there is nothing to send yet
+ */
+static int TransmitByte(uint8_t port)
+{
+  TxState *t = &tx[port];
+  uint8_t  c;
+
+  switch (t->state) {
+    case TX_IDLE:
+      if (t->head == t->tail)
+        return -1;
+      t->state = TX_DATA;
+      return PKT_END;
+
+    case TX_ESCAPED:
+      t->state = TX_DATA;
+      c = t->buf[t->head];
+      t->head = (t->head+1) & TX_BUFFER_MASK;
+      return c == PKT_END ? PKT_ESC_END : PKT_ESC_ESC;
+
+    default:
+      if (t->endHead != t->endTail && t->head == t->ends[t->endHead]) {
+        t->endHead = (t->endHead+1) & TX_FRAMES_MASK;
+        t->state   = TX_IDLE;
+        return PKT_END;
+      }
+      if (t->head == t->tail)
+        return -1;
+
+      c = t->buf[t->head];
+      if (c == PKT_END || c == PKT_ESC) {
+        t->state = TX_ESCAPED;
+        return PKT_ESC;
+      }
+      t->head = (t->head+1) & TX_BUFFER_MASK;
+      return c;
+  }
+}
+
+
+/**
+ * Update the packet CRC up to a buffer position.
+ * The CRC is computed when data is released, so
+ * record lengths can still be filled in before.
+ *
+ */
+static void UpdateCrc(uint8_t upto)
+{
+  TxState *t = &tx[txPort];
+  while (txCrcPos != upto) {
+    txCrc    = _crc_ccitt_update(txCrc, t->buf[txCrcPos]);
+    txCrcPos = (txCrcPos+1) & TX_BUFFER_MASK;
+  }
+}
+
+
+/**
+ * Release packet data up to a buffer position for sending.
+ *
+ */
+static void Release(uint8_t upto)
+{
+  UpdateCrc(upto);
+  tx[txPort].tail = upto;
+  UART_StartTx(txPort);
+}
+
+
+/**
+ * Release the current packet data for sending and
+ * wait until the transmit buffer has some free space.
+ * Only needed for packets that don't fit into the buffer.
+ *
+ * \return false if the buffer is full with an open record
+ */
+static bool WaitTxSpace()
+{
+  TxState *t     = &tx[txPort];
+  uint8_t  limit = txHold ? txMark : txPos;
+
+  Release(limit);
+  while (((txPos+1) & TX_BUFFER_MASK) == t->head) {
+    if (t->head == limit)
+      return false;
+    wdt_reset();
+  }
+  return true;
+}
+
+
+/**
+ * Begin a packet on the given port.
+ * All following PKT_Send* calls go to this
+ * port, up to PKT_EndPacket().
+ *
+ * \param  port  serial port
+ */
+inline void PKT_BeginPacket(uint8_t port)
+{
+  txPort   = port;
+  txCrc    = 0xffff;
+  txPos    = tx[port].tail;
+  txCrcPos = txPos;
+}
 
 
 /**
@@ -39,25 +230,15 @@ static   bool         rxEsc;   ///< Last byte was an escape symbol
  */
 inline void PKT_SendByte(uint8_t u8)
 {
-  if (txLen == 0) {
-    UART_PutChar(PKT_END);
-    txCrc = 0xffff;
-  }
-  switch (u8) {
-    case PKT_END:
-      UART_PutChar(PKT_ESC);
-      UART_PutChar(PKT_ESC_END);
-      break;
-    case PKT_ESC:
-      UART_PutChar(PKT_ESC);
-      UART_PutChar(PKT_ESC_ESC);
-      break;
-    default:
-      UART_PutChar(u8);
-      break;
+  if (txOverflow)
+    return;
+
+  if (((txPos+1) & TX_BUFFER_MASK) == tx[txPort].head && !WaitTxSpace()) {
+    txOverflow = true;
+    return;
   }
-  txCrc = _crc_ccitt_update(txCrc, u8);
-  txLen++;
+  tx[txPort].buf[txPos] = u8;
+  txPos = (txPos+1) & TX_BUFFER_MASK;
 }
 
 
@@ -87,101 +268,511 @@ inline void PKT_SendUInt32(uint32_t u32)
 
 /**
  * Send a block of data.
+ * The data is copied into the transmit buffer
+ * with at most two memcpy() calls.
  *
  * \param  data  pointer to data
  * \param  len   length of data
  */
 inline void PKT_SendBlock(const void *data, int len)
 {
-  const char *c = data;
-  while (len--)
-    PKT_SendByte(*c++);
+  TxState       *t = &tx[txPort];
+  const uint8_t *c = data;
+
+  while (len > 0 && !txOverflow) {
+    uint8_t free = (t->head - txPos - 1) & TX_BUFFER_MASK;
+    if (!free) {
+      if (!WaitTxSpace())
+        txOverflow = true;
+      continue;
+    }
+    uint8_t  n    = len < free ? len : free;
+    uint16_t span = PKT_TX_BUFFER_SIZE - txPos;
+    if (span > n)
+      span = n;
+    memcpy(&t->buf[txPos], c, span);
+    memcpy(&t->buf[0], c + span, n - span);
+
+    txPos  = (txPos + n) & TX_BUFFER_MASK;
+    c     += n;
+    len   -= n;
+  }
 }
 
 
 /**
  * Send end-of-packet.
+ * Appends the CRC and releases the packet for
+ * sending. Only waits if the buffer is full.
  * 
  */
 inline void PKT_EndPacket()
 {
-  PKT_SendUInt16(txCrc);
-  UART_PutChar(PKT_END);
-  txLen = 0;
+  TxState *t = &tx[txPort];
+
+  UpdateCrc(txPos);
+  uint16_t crc = txCrc;
+  PKT_SendUInt16(crc);
+
+  while (((t->endTail+1) & TX_FRAMES_MASK) == t->endHead)
+    wdt_reset();
+
+  txCrcPos = txPos;
+  t->tail  = txPos;
+  t->ends[t->endTail] = txPos;
+  t->endTail = (t->endTail+1) & TX_FRAMES_MASK;
+  UART_StartTx(txPort);
+}
+
+
+/**
+ * Send a signed value as zigzag varint.
+ * Small values of either sign take one byte,
+ * any 16 bit value takes at most three.
+ *
+ * \param  i16  value to send
+ */
+void PKT_SendVarint(int16_t i16)
+{
+  uint16_t u = ((uint16_t)i16 << 1) ^ (uint16_t)(i16 >> 15);
+  while (u >= 0x80) {
+    PKT_SendByte(u | 0x80);
+    u >>= 7;
+  }
+  PKT_SendByte(u);
+}
+
+
+/**
+ * Set up a delta encoded sample stream.
+ *
+ * \param  d            stream state
+ * \param  ref          buffer for the acknowledged sample
+ * \param  sent         buffer for the last samples sent,
+ *                      count * PKT_DELTA_HISTORY values
+ * \param  count        values per sample
+ * \param  keyInterval  send a keyframe every keyInterval samples
+ */
+void PKT_InitDelta(PKT_Delta *d, unsigned *ref, unsigned *sent,
+                   uint8_t count, uint8_t keyInterval)
+{
+  d->ref         = ref;
+  d->sent        = sent;
+  d->count       = count;
+  d->keyInterval = keyInterval;
+  d->keyCount    = 0;
+  d->history     = 0;
+  d->refValid    = false;
+}
+
+
+/**
+ * Send a sample of a delta encoded stream.
+ * Sent as [id][base id][varint...], each varint being
+ * the difference to the sample with the base id. For
+ * keyframes the base id equals the id, and the values
+ * are sent as raw uint16_t.
+ *
+ * \param  d       stream state
+ * \param  values  sample to send
+ */
+void PKT_SendDelta(PKT_Delta *d, const unsigned *values)
+{
+  uint8_t id = ++d->id;
+
+  // Deltas need an acknowledged reference. Force a
+  // keyframe before the ids wrap around to it.
+  //
+  bool key = !d->refValid || !d->keyCount ||
+             (uint8_t)(id - d->refId) >= 128;
+  if (key)
+    d->keyCount = d->keyInterval;
+  d->keyCount--;
+
+  PKT_SendByte(id);
+  PKT_SendByte(key ? id : d->refId);
+
+  unsigned *sent = &d->sent[(id % PKT_DELTA_HISTORY) * d->count];
+  for (uint8_t i=0; i<d->count; i++) {
+    if (key)
+      PKT_SendUInt16(values[i]);
+    else
+      PKT_SendVarint((int16_t)(values[i] - d->ref[i]));
+    sent[i] = values[i];
+  }
+  if (d->history < PKT_DELTA_HISTORY)
+    d->history++;
+}
+
+
+/**
+ * Acknowledge a sample of a delta encoded stream.
+ * Any of the last PKT_DELTA_HISTORY samples sent can be
+ * acknowledged, it becomes the reference for following
+ * deltas. Acks older than the reference are ignored.
+ *
+ * \param  d   stream state
+ * \param  id  id of the sample received by the host
+ */
+void PKT_AckDelta(PKT_Delta *d, uint8_t id)
+{
+  if ((uint8_t)(d->id - id) >= d->history)
+    return;
+  if (d->refValid && (int8_t)(id - d->refId) <= 0)
+    return;
+
+  unsigned *sent = &d->sent[(id % PKT_DELTA_HISTORY) * d->count];
+  for (uint8_t i=0; i<d->count; i++)
+    d->ref[i] = sent[i];
+  d->refId    = id;
+  d->refValid = true;
+}
+
+
+/**
+ * Begin a length-prefixed record in the current packet.
+ * The record is held in the transmit buffer until
+ * PKT_EndRecord() fills in its length byte, so a
+ * record can't be longer than the buffer.
+ *
+ */
+void PKT_BeginRecord()
+{
+  PKT_SendByte(0);
+  txMark = (txPos - 1) & TX_BUFFER_MASK;
+  txHold = true;
+}
+
+
+/**
+ * End a record and fill in its length byte.
+ * A record that didn't fit is removed completely.
+ *
+ * \return false if the record didn't fit
+ */
+bool PKT_EndRecord()
+{
+  txHold = false;
+  if (txOverflow) {
+    txOverflow = false;
+    txPos = txMark;
+    return false;
+  }
+  tx[txPort].buf[txMark] = (txPos - txMark - 1) & TX_BUFFER_MASK;
+  return true;
+}
+
+
+/**
+ * Wait until all packets of a port are sent.
+ *
+ * \param  port  serial port
+ */
+void PKT_Flush(uint8_t port)
+{
+  TxState *t = &tx[port];
+  while (t->endHead != t->endTail || t->state != TX_IDLE)
+    wdt_reset();
+}
+
+
+/**
+ * Set up the transmit buffer of a port.
+ *
+ * \param  port  serial port
+ */
+void PKT_BeginTransmit(uint8_t port)
+{
+  TxState *t = &tx[port];
+  UART_SetTxHandler(port, 0);
+
+  t->head    = t->tail    = 0;
+  t->endHead = t->endTail = 0;
+  t->state   = TX_IDLE;
+
+  UART_SetTxHandler(port, TransmitByte);
+}
+
+
+/**
+ * Claim a free receive slot.
+ * The receive handlers of both ports may nest,
+ * so this is done with interrupts disabled.
+ *
+ * \return slot number, or -1 if all slots are in use
+ */
+static int8_t ClaimSlot()
+{
+  int8_t  slot = -1;
+  uint8_t sreg = SREG;
+  cli();
+  for (uint8_t i=0; i<PKT_RX_SLOTS; i++) {
+    if (rxFree & _BV(i)) {
+      rxFree &= ~_BV(i);
+      slot = i;
+      break;
+    }
+  }
+  SREG = sreg;
+  return slot;
+}
+
+
+/**
+ * Return a receive slot to the free pool.
+ *
+ */
+static void FreeSlot(int8_t slot)
+{
+  uint8_t sreg = SREG;
+  cli();
+  rxFree |= _BV(slot);
+  SREG = sreg;
 }
 
 
 /**
- * Begin asynchronous packet receive.
+ * Queue a receive error for PKT_ReceiveAsync().
+ * If the queue is full the error is dropped, the host
+ * then has to time out. That only happens if it sends
+ * well beyond the command window.
+ *
+ * \param  r         receive state of the port
+ * \param  error     error code
+ * \param  seq, cmd  header of the rejected packet
+ */
+static void Reject(RxState *r, int8_t error, char seq, char cmd)
+{
+  if (r->errLen == RX_REJECTS)
+    return;
+
+  uint8_t i = (r->errHead + r->errLen) % RX_REJECTS;
+  r->errors[i]        = error;
+  r->errHeaders[i][0] = seq;
+  r->errHeaders[i][1] = cmd;
+  r->errLen++;
+}
+
+
+/**
+ * Receive one character.
+ * Called from the UART receive interrupt. Bytes are
+ * de-escaped straight into a packet slot and the CRC
+ * is updated on the fly, so a packet is complete and
+ * verified when its end symbol arrives.
+ *
+ * Packets that find no free slot or don't fit into
+ * one are still checked, so the main loop can reject
+ * them by sequence number. Empty packets are rejected
+ * with a zero header.
+ *
+ * \param  port  serial port
+ * \param  c     received character
+ */
+static void ReceiveByte(uint8_t port, char c)
+{
+  RxState *r = &rx[port];
+
+  switch (c) {
+    case PKT_ESC:
+      r->esc = true;
+      break;
+
+    case PKT_END:
+      if (r->pos >= 2) {
+        // Rejections are queued, so each one reaches the
+        // host in order. It would wait for the sequence
+        // number forever otherwise. CRC errors carry no
+        // usable header, they are only noted if nothing
+        // else is pending, so noise can't crowd out the
+        // rejections.
+        //
+        if (r->crc != 0) {
+          if (!r->errLen)
+            Reject(r, ERR_CRC, 0, 0);
+        }
+        else if (r->drop)
+          Reject(r, r->drop, r->header[0], r->header[1]);
+        else if (r->pos == 2) {
+          // Empty packet, rejected like a
+          // packet without a command
+          //
+          Reject(r, ERR_DATA_LENGTH, 0, 0);
+        }
+        else {
+          rxSlots[r->slot].length = r->pos - 2;
+          rxSlots[r->slot].port   = port;
+          rxSlots[r->slot].marked = r->marked;
+
+          uint8_t sreg = SREG;
+          cli();
+          rxQueue[(rxQueueHead + rxQueueLen) % PKT_RX_SLOTS] = r->slot;
+          rxQueueLen++;
+          SREG = sreg;
+          r->slot = -1;
+        }
+      }
+      r->pos  = 0;
+      r->crc  = 0xffff;
+      r->esc  = false;
+      r->drop = 0;
+      r->marked = false;
+      break;
+
+    default:
+      if (r->esc) {
+        if (c == PKT_ESC_END)
+          c = PKT_END;
+        else if (c == PKT_ESC_ESC)
+          c = PKT_ESC;
+        r->esc = false;
+      }
+      r->crc = _crc_ccitt_update(r->crc, c);
+      if (r->pos < 2)
+        r->header[r->pos] = c;
+
+      if (!r->drop) {
+        if (r->slot < 0 && (r->slot = ClaimSlot()) < 0)
+          r->drop = ERR_QUEUE_FULL;
+        else if (r->pos >= PKT_SLOT_SIZE)
+          r->drop = ERR_OVERFLOW;
+        else
+          rxSlots[r->slot].data[r->pos] = c;
+      }
+      if (r->pos < 255)
+        r->pos++;
+      break;
+  }
+}
+
+
+/**
+ * Begin asynchronous packet receive on a port.
+ * Packets are decoded by the receive interrupt into
+ * PKT_RX_SLOTS slots of PKT_SLOT_SIZE bytes, shared
+ * by all ports.
  * 
  * \note   Packets are always received including the 16bit CRC, so
- *         the buffer needs to be 2 bytes bigger than the user data.
+ *         a slot holds up to PKT_SLOT_SIZE-2 bytes of user data.
  *
- * \param  data   pointer to packet receive buffer
- * \param  len    length of packet receive buffer
+ * \param  port   serial port
  */
-inline void PKT_BeginReceive(void *data, int len)
+void PKT_BeginReceive(uint8_t port)
 {
-  rxBuf = data;
-  rxBufSize = len;
-  rxPos = 0;
-  rxEsc = false;
-}
+  RxState *r = &rx[port];
+  UART_SetRxHandler(port, 0);
 
+  if (r->slot >= 0)
+    FreeSlot(r->slot);
+  r->slot  = -1;
+  r->pos   = 0;
+  r->crc   = 0xffff;
+  r->esc   = false;
+  r->drop  = 0;
+  r->marked = false;
+  r->errHead = 0;
+  r->errLen  = 0;
+
+  UART_SetRxHandler(port, ReceiveByte);
+}
 
 
 /**
  * Receive a packet asynchronously.
+ * Packets from all ports are returned in arrival order.
+ * The packet stays valid until PKT_ReleaseReceive(),
+ * while more are received into the other slots.
+ *
+ * For ERR_QUEUE_FULL, ERR_OVERFLOW and ERR_DATA_LENGTH,
+ * data points to the sequence number and command of the
+ * rejected packet.
+ *
  * \see  PKT_BeginReceive()
+ * \param  port   receives the port of the packet
+ * \param  data   receives a pointer to the packet
  * \return 
  *    0  No packet received
- *   >0  Length of received packet (including 2 bytes of CRC)
+ *   >0  Length of received packet (without CRC)
  *   <0  Error code
  */
-inline int PKT_ReceiveAsync()
-{
-  int length;
-  while (UART_CharsAvail()) {
-    char   c = UART_GetChar();
-
-    switch (c) {
-      case PKT_ESC:
-        rxEsc = true;
-        break;
-      
-      case PKT_END:
-        length = rxPos;
-        rxPos  = 0;
-        rxEsc  = false;
-
-        if (length >= 2) {
-          unsigned crc = 0xffff;
-          for (int i=0; i<length; i++)
-            crc = _crc_ccitt_update(crc, rxBuf[i]);
-          if (crc == 0)
-            return length-2;
-          else
-            return ERR_CRC;
-        }
-        break;
-
-      default:
-        if (rxPos < rxBufSize) {
-          if (rxEsc && c==PKT_ESC_END) 
-            c = PKT_END;
-          if (rxEsc && c==PKT_ESC_ESC)
-            c = PKT_ESC;
-          rxBuf[rxPos++] = c;
-          rxEsc = false;
-        }
-        else {
-          rxPos = 0;
-          rxEsc = false;
-          return ERR_OVERFLOW;
-        }
-        break;
+int PKT_ReceiveAsync(uint8_t *port, char **data)
+{
+  if (rxQueueLen) {
+    uint8_t sreg = SREG;
+    cli();
+    rxCurrent   = rxQueue[rxQueueHead];
+    rxQueueHead = (rxQueueHead+1) % PKT_RX_SLOTS;
+    rxQueueLen--;
+    SREG = sreg;
+
+    *port    = rxSlots[rxCurrent].port;
+    *data    = rxSlots[rxCurrent].data;
+    rxMarked = rxSlots[rxCurrent].marked;
+    return rxSlots[rxCurrent].length;
+  }
+
+  for (uint8_t p=0; p<UART_PORTS; p++) {
+    RxState *r = &rx[p];
+    if (r->errLen) {
+      uint8_t sreg = SREG;
+      cli();
+      int8_t err = r->errors[r->errHead];
+      rxRejected[0] = r->errHeaders[r->errHead][0];
+      rxRejected[1] = r->errHeaders[r->errHead][1];
+      r->errHead = (r->errHead+1) % RX_REJECTS;
+      r->errLen--;
+      SREG = sreg;
+
+      *port = p;
+      *data = rxRejected;
+      return err;
     }
-  }  
+  }
   return 0;
 }
 
+
+/**
+ * Mark the packets of a port received so far, including
+ * one still being received, e.g. at a baud rate change.
+ *
+ * \see  PKT_IsMarked()
+ * \param  port  serial port
+ */
+void PKT_MarkReceived(uint8_t port)
+{
+  uint8_t sreg = SREG;
+  cli();
+  for (uint8_t i=0; i<rxQueueLen; i++) {
+    RxSlot *slot = &rxSlots[rxQueue[(rxQueueHead + i) % PKT_RX_SLOTS]];
+    if (slot->port == port)
+      slot->marked = true;
+  }
+  rx[port].marked = rx[port].pos > 0;
+  SREG = sreg;
+}
+
+
+/**
+ * Check if the packet returned by PKT_ReceiveAsync()
+ * began before the last PKT_MarkReceived() of its port.
+ *
+ */
+bool PKT_IsMarked()
+{
+  return rxMarked;
+}
+
+
+/**
+ * Hand the packet returned by PKT_ReceiveAsync()
+ * back to the receive interrupt.
+ *
+ */
+void PKT_ReleaseReceive()
+{
+  if (rxCurrent >= 0) {
+    FreeSlot(rxCurrent);
+    rxCurrent = -1;
+  }
+}
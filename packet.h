@@ -11,6 +11,7 @@
 #define  PACKET_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 
 // Error Codes
 //
@@ -21,14 +22,57 @@
 #define  ERR_UNKNOWN_CMD     -4   ///< Unknown command
 #define  ERR_DATA_LENGTH     -5   ///< Data length mismatch
 #define  ERR_BATTERY_LOW     -6   ///< Battery low, command ignored
+#define  ERR_QUEUE_FULL      -7   ///< Queue full, command ignored
+#define  ERR_RANGE           -8   ///< Parameter out of range
 
+// An ack must arrive before PKT_DELTA_HISTORY more samples
+// are sent, later ones are ignored and the stream keeps
+// sending keyframes. Callers must limit the sample rate.
+//
+#define  PKT_DELTA_HISTORY    2   ///< Sent samples that can be acknowledged
+
+/**
+ * Delta encoded sample stream.
+ * Samples are sent as zigzag varint differences
+ * to the last sample acknowledged by the host.
+ */
+typedef struct {
+  unsigned   *ref;             ///< Acknowledged reference sample
+  unsigned   *sent;            ///< Last PKT_DELTA_HISTORY samples sent
+  uint8_t     count;           ///< Values per sample
+  uint8_t     history;         ///< Samples in sent history
+  uint8_t     id;              ///< Id of the last sample sent
+  uint8_t     refId;           ///< Id of the reference sample
+  bool        refValid;        ///< Reference sample was acknowledged
+  uint8_t     keyInterval;     ///< Samples between keyframes
+  uint8_t     keyCount;        ///< Samples until the next keyframe
+} PKT_Delta;
+
+#define  PKT_SLOT_SIZE      128   ///< Receive slot size, including CRC
+#define  PKT_RX_SLOTS         4   ///< Receive slots, shared by all ports
+#define  PKT_TX_FRAMES        8   ///< Max. queued transmit packets per port, minus one
+#define  PKT_TX_BUFFER_SIZE 128   ///< Transmit ring size per port, power of 2
+
+extern void  PKT_BeginPacket(uint8_t port);
 extern void  PKT_SendByte(uint8_t u8);
 extern void  PKT_SendUInt16(uint16_t u16);
 extern void  PKT_SendUInt32(uint32_t u32);
 extern void  PKT_SendBlock(const void *data, int len);
 extern void  PKT_EndPacket();
+extern void  PKT_SendVarint(int16_t i16);
+extern void  PKT_InitDelta(PKT_Delta *d, unsigned *ref, unsigned *sent,
+                           uint8_t count, uint8_t keyInterval);
+extern void  PKT_SendDelta(PKT_Delta *d, const unsigned *values);
+extern void  PKT_AckDelta(PKT_Delta *d, uint8_t id);
+extern void  PKT_BeginRecord();
+extern bool  PKT_EndRecord();
+extern void  PKT_Flush(uint8_t port);
+extern void  PKT_BeginTransmit(uint8_t port);
 
-extern void  PKT_BeginReceive(void *data, int len);
-extern int   PKT_ReceiveAsync();
+extern void  PKT_BeginReceive(uint8_t port);
+extern int   PKT_ReceiveAsync(uint8_t *port, char **data);
+extern void  PKT_ReleaseReceive();
+extern void  PKT_MarkReceived(uint8_t port);
+extern bool  PKT_IsMarked();
 
 #endif
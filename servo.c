@@ -12,8 +12,11 @@
 //
 #include "servo.h"
 #include <inttypes.h>
-#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/signal.h>
 
 // Microseconds to CPU ticks
 //
@@ -23,200 +26,936 @@
 //
 #define  MAX_SERVO_TIME  US_TICKS(2500)
 
+// Output stage timing (in CPU ticks)
+//
+// The compare interrupt fires ISR_LEAD ticks before an event, busy
+// waits until the event is FINE_TICKS ahead and hands over to
+// SRV_OutputAt(), which burns the rest cycle by cycle. Events
+// closer than EVENT_TICKS can't be written separately, they are
+// moved to the nearest feasible slot by SRV_BuildSchedule().
+//
+#define  OUT_LATENCY     18   ///< Cycles from TCNT1 sample to first OUT
+#define  FINE_TICKS      (OUT_LATENCY + 24)
+#define  EVENT_TICKS     40   ///< Minimum distance of two events
+#define  ISR_LEAD        US_TICKS(4)
+#define  ISR_MAX_HOLD    US_TICKS(20)  ///< Output ISR time before received characters get a turn
+#define  ISR_YIELD       US_TICKS(10)  ///< Time they get before the ISR comes back
+#define  SAMPLE_TICKS    20   ///< Cycles per readback sampling loop
+#define  FRAME_LEAD      (2*ISR_LEAD)
+
 
 typedef struct {
   uint16_t  tick;     ///< Time of event
   uint8_t   a, b, c;  ///< I/O Port status
 } ServoEvent;
 
-static ServoEvent servoEvents[24];
+/**
+ * Precomputed servo frame.
+ */
+typedef struct {
+  unsigned    positions[24];   ///< Positions the events were built from
+  uint16_t    feedbackGen;     ///< Feedback offsets the events were built with
+  bool        valid;           ///< Event table matches positions
+  uint8_t     count;           ///< Number of events
+  ServoEvent  events[1+24+1];  ///< Start + merged events + end-of-frame
+} ServoSchedule;
+
+static ServoSchedule  schedules[2];
+static ServoEvent     readEvents[24+1];   ///< Scratch table for readback
+static uint16_t       sortKeys[24];       ///< Clamped positions by channel
+static uint8_t        sortOrder[24];      ///< Channels in ascending key order
+
+static volatile bool           frameActive;    ///< Servo frame in progress
+static ServoSchedule *volatile frameSchedule;  ///< Schedule of current/last frame
+static ServoSchedule *volatile nextSchedule;   ///< Swapped in at next frame boundary
+static volatile bool           frameTick;      ///< Frame timer fired
+static volatile bool           holdFrames;     ///< Don't start frames
+static          uint16_t       frameStart;     ///< Timer1 value at frame start
+static const    ServoEvent    *nextEvent;      ///< Next event for output ISR
+static const    ServoEvent    *frameEnd;       ///< End-of-frame event
+static          uint16_t       isrTicks;       ///< ISR ticks in current frame
+
+// Readback states
+//
+#define  READ_IDLE       0    ///< No readback
+#define  READ_REQUEST    1    ///< Sending the 100us request pulse
+#define  READ_ANSWER     2    ///< Waiting for the answer to start
+#define  READ_SKIP       3    ///< Skipping the low phase of the answer
+#define  READ_DONE       4    ///< Edges sampled, see SRV_PollReadback()
+
+static volatile uint8_t        readState;      ///< READ_xxx
+static          uint16_t       readStart;      ///< Timer1 value at readback start
+static          ServoEvent    *readEnd;        ///< End of sampled edges
+
+static volatile SRV_Stats   stats;
+static const    ServoCalib *calibration;   ///< Table of 24 entries, or NULL
+static volatile uint8_t     maxLate[24];   ///< Worst edge lateness by channel
+static          int16_t     feedback[24];  ///< Offsets added to target positions
+static          uint16_t    feedbackGen;   ///< Incremented when feedback changes
+
+
+
+/**
+ * Apply calibration to a target position.
+ *
+ * \param  c    calibration entry
+ * \param  pos  target position in CPU ticks
+ * \return servo position in CPU ticks
+ */
+static uint16_t SRV_Calibrate(const ServoCalib *c, uint16_t pos)
+{
+  int32_t d = (int32_t)pos - SRV_CENTER;
+  if (c->flags & SRV_INVERT)
+    d = -d;
+  d = (d * c->scale) >> 14;
+  d += SRV_CENTER + c->offset;
+
+  if (d < c->min)  d = c->min;
+  if (d > c->max)  d = c->max;
+  return d;
+}
+
+
+/**
+ * Undo calibration of a read back position.
+ * Clamping can't be undone, of course.
+ *
+ * \param  c    calibration entry
+ * \param  pos  servo position in CPU ticks
+ * \return target position in CPU ticks
+ */
+static uint16_t SRV_Uncalibrate(const ServoCalib *c, uint16_t pos)
+{
+  if (!c->scale)
+    return pos;
+
+  int32_t d = (int32_t)pos - SRV_CENTER - c->offset;
+  d = (d << 14) / c->scale;
+  if (c->flags & SRV_INVERT)
+    d = -d;
+  d += SRV_CENTER;
+
+  if (d < 0)       d = 0;
+  if (d > 0xffff)  d = 0xffff;
+  return d;
+}
+
 
+/**
+ * Get the falling edge time of a channel, with feedback
+ * and calibration applied.
+ *
+ * \param  positions  array of 24 servo target positions.
+ * \param  ch         channel
+ * \return edge time in CPU ticks since the frame start
+ */
+static uint16_t SRV_EdgeTick(const unsigned *positions, uint8_t ch)
+{
+  // Unused (zero) channels stay low, feedback and
+  // calibration are not applied to them.
+  //
+  int32_t  mix = positions[ch] ? (int32_t)positions[ch] + feedback[ch] : 0;
+  uint16_t pos = mix < 0 ? 0 : mix > 0xffff ? 0xffff : mix;
+  if (calibration && positions[ch])
+    pos = SRV_Calibrate(&calibration[ch], pos);
+  return pos < MAX_SERVO_TIME ? pos : MAX_SERVO_TIME-1;
+}
 
 
 /**
- * qsort compare function for uint16
+ * Sort channels by target position.
+ *
+ * Insertion sort on the channel index array, starting from the
+ * order of the last build. A channel that keeps its place costs
+ * a single compare, so streaming small joint deltas re-sorts in
+ * nearly linear time (roughly 1000 cycles for 24 channels, where
+ * qsort() on the 5 byte event structs needed >10000).
  *
- * \param va  pointer to first integer
- * \param vb  pointer to second integer
- * \return  1 if a>b, -1 if a<b, 0 if equal
+ * \param  positions  array of 24 servo target positions.
  */
-static int compare_uint16(const void *va, const void *vb)
+static void SRV_SortChannels(unsigned *positions)
 {
-  uint16_t a = *(uint16_t*)va;
-  uint16_t b = *(uint16_t*)vb;
-  if (a > b)  return  1;
-  if (a < b)  return -1;
-  return 0;
+  for (uint8_t i=0; i<24; i++)
+    sortKeys[i] = SRV_EdgeTick(positions, i);
+
+  for (uint8_t i=1; i<24; i++) {
+    uint8_t   ch  = sortOrder[i];
+    uint16_t  key = sortKeys[ch];
+    uint8_t   j   = i;
+    while (j > 0 && sortKeys[sortOrder[j-1]] > key) {
+      sortOrder[j] = sortOrder[j-1];
+      j--;
+    }
+    sortOrder[j] = ch;
+  }
 }
 
 
+/**
+ * Write one event to the servo ports at an exact Timer1 tick.
+ *
+ * Samples TCNT1L, burns the remaining cycles in a nop sled and
+ * writes DDRA, DDRB and DDRC with three consecutive OUTs. The
+ * first OUT executes exactly OUT_LATENCY + sled cycles after
+ * the sample, so it hits the due tick if called no more than
+ * FINE_TICKS ahead. If the event is already due, the sled is
+ * skipped and the OUTs follow OUT_LATENCY cycles after the
+ * sample, both paths take the same time up to the sled.
+ *
+ * \param  due    Timer1 tick of the event (only the low byte is used)
+ * \param  a,b,c  port values
+ * \return ticks the write was late, 0 if on time
+ */
+static inline uint8_t SRV_OutputAt(uint16_t due, uint8_t a, uint8_t b, uint8_t c)
+{
+  uint8_t late;
+  __asm__ __volatile__ (
+    "clr   %[late]                \n\t"
+    "in    __tmp_reg__, %[tcntl]  \n\t"   // 1  sample timer
+    "mov   r30, %[due]            \n\t"   // 1
+    "sub   r30, __tmp_reg__       \n\t"   // 1
+    "subi  r30, %[lat]            \n\t"   // 1  r30 = cycles to burn
+    "brmi  2f                     \n\t"   // 1
+    "nop                          \n\t"   // 1
+    "rjmp  1f                     \n\t"   // 2
+    "2:                           \n\t"   // already late: (2)
+    "sub   %[late], r30           \n\t"   // (1)  late = -r30
+    "clr   r30                    \n\t"   // (1)  empty sled
+    "1:                           \n\t"
+    "cpi   r30, 32                \n\t"   // 1
+    "brlo  3f                     \n\t"   // 2
+    "ldi   r30, 31                \n\t"
+    "3:                           \n\t"
+    "mov   __tmp_reg__, r30       \n\t"   // 1
+    "ldi   r30, lo8(pm(4f))       \n\t"   // 1
+    "ldi   r31, hi8(pm(4f))       \n\t"   // 1
+    "sub   r30, __tmp_reg__       \n\t"   // 1
+    "sbc   r31, __zero_reg__      \n\t"   // 1
+    "ijmp                         \n\t"   // 2  = OUT_LATENCY
+    ".rept 31                     \n\t"
+    "nop                          \n\t"
+    ".endr                        \n\t"
+    "4:                           \n\t"
+    "out   %[ddra], %[a]          \n\t"
+    "out   %[ddrb], %[b]          \n\t"
+    "out   %[ddrc], %[c]          \n\t"
+    : [late]  "=&r" (late)
+    : [due]   "r" ((uint8_t)due),
+      [a]     "r" (a),
+      [b]     "r" (b),
+      [c]     "r" (c),
+      [lat]   "M" (OUT_LATENCY),
+      [tcntl] "I" (_SFR_IO_ADDR(TCNT1L)),
+      [ddra]  "I" (_SFR_IO_ADDR(DDRA)),
+      [ddrb]  "I" (_SFR_IO_ADDR(DDRB)),
+      [ddrc]  "I" (_SFR_IO_ADDR(DDRC))
+    : "r30", "r31"
+  );
+  return late;
+}
+
+
+/**
+ * Wait for a falling edge on the servo ports.
+ *
+ * Cycle-counted sampling loop: pins and Timer1 are read together
+ * with interrupts disabled, every SAMPLE_TICKS cycles unless an
+ * interrupt runs in between. Returns on the first sample where a
+ * pin in the a/b/c masks went low, or when OCF1A is set.
+ *
+ * \param  a,b,c  last pin states, updated with the masked sample
+ * \param  time   Timer1 at the last sample, updated with the
+ *                time of the returned sample
+ * \return Timer1 at the last sample without change
+ */
+static inline uint16_t SRV_SampleEdge(uint8_t *a, uint8_t *b, uint8_t *c, uint16_t *time)
+{
+  uint8_t   pa, pb, pc;
+  uint16_t  t = *time, p;
+  __asm__ __volatile__ (
+    "1:                           \n\t"
+    "movw  %A[p], %A[t]           \n\t"   // 1
+    "in    __tmp_reg__, __SREG__  \n\t"   // 1
+    "cli                          \n\t"   // 1
+    "in    %[pa], %[pina]         \n\t"   // 1  sample pins
+    "in    %[pb], %[pinb]         \n\t"   // 1
+    "in    %[pc], %[pinc]         \n\t"   // 1
+    "in    %A[t], %[tcntl]        \n\t"   // 1  and timer
+    "in    %B[t], %[tcnth]        \n\t"   // 1
+    "out   __SREG__, __tmp_reg__  \n\t"   // 1
+    "and   %[pa], %[a]            \n\t"   // 1
+    "and   %[pb], %[b]            \n\t"   // 1
+    "and   %[pc], %[c]            \n\t"   // 1
+    "cp    %[pa], %[a]            \n\t"   // 1
+    "cpc   %[pb], %[b]            \n\t"   // 1
+    "cpc   %[pc], %[c]            \n\t"   // 1
+    "brne  2f                     \n\t"   // 1
+    "in    __tmp_reg__, %[tifr]   \n\t"   // 1
+    "sbrs  __tmp_reg__, %[ocf]    \n\t"   // 1
+    "rjmp  1b                     \n\t"   // 2  = SAMPLE_TICKS
+    "2:                           \n\t"
+    : [pa]    "=&r" (pa),
+      [pb]    "=&r" (pb),
+      [pc]    "=&r" (pc),
+      [p]     "=&r" (p),
+      [t]     "+r" (t)
+    : [a]     "r" (*a),
+      [b]     "r" (*b),
+      [c]     "r" (*c),
+      [ocf]   "I" (OCF1A),
+      [pina]  "I" (_SFR_IO_ADDR(PINA)),
+      [pinb]  "I" (_SFR_IO_ADDR(PINB)),
+      [pinc]  "I" (_SFR_IO_ADDR(PINC)),
+      [tcntl] "I" (_SFR_IO_ADDR(TCNT1L)),
+      [tcnth] "I" (_SFR_IO_ADDR(TCNT1H)),
+      [tifr]  "I" (_SFR_IO_ADDR(TIFR))
+  );
+  *a = pa;  *b = pb;  *c = pc;
+  *time = t;
+  return p;
+}
+
+
+/**
+ * Account a late edge to the channels switched by an event.
+ * Only called if something went wrong, so it may be slow.
+ *
+ * \param  e     late event
+ * \param  late  lateness in ticks
+ */
+static void SRV_RecordLate(const ServoEvent *e, uint8_t late)
+{
+  uint8_t a = 0xff, b = 0xff, c = 0xff;
+
+  // A late start-of-frame event shortens all pulses
+  //
+  if (e != frameSchedule->events) {
+    const ServoEvent *prev = e - 1;
+    a = e->a & ~prev->a;
+    b = e->b & ~prev->b;
+    c = e->c & ~prev->c;
+  }
+
+  for (uint8_t i=0; i<8; i++) {
+    uint8_t bit = 1<<i;
+    if ((a & bit) && late > maxLate[i   ])  maxLate[i   ] = late;
+    if ((b & bit) && late > maxLate[i+ 8])  maxLate[i+ 8] = late;
+    if ((c & bit) && late > maxLate[i+16])  maxLate[i+16] = late;
+  }
+  stats.lateEdges++;
+}
+
+
+/**
+ * Start a servo frame.
+ * Must be called with interrupts disabled.
+ *
+ * \param  s  schedule to output
+ */
+static void SRV_StartFrame(ServoSchedule *s)
+{
+  // Timer1 is free-running, all event ticks are relative
+  // to frameStart. The rising edges are written by the
+  // ISR as the first event.
+  //
+  frameStart    = TCNT1 + FRAME_LEAD;
+  frameSchedule = s;
+  nextEvent     = s->events;
+  frameEnd      = &s->events[s->count-1];
+  isrTicks      = 0;
+  frameActive   = true;
+
+  OCR1A  = frameStart - ISR_LEAD;
+  TIFR   = _BV(OCF1A);
+  TIMSK |= _BV(OCIE1A);
+}
+
+
+/**
+ * Timer3 compare interrupt.
+ * Starts a servo frame at a fixed rate, independent of
+ * when new targets arrive. Without new targets the last
+ * frame is repeated, so the servos keep holding.
+ */
+SIGNAL(SIG_OUTPUT_COMPARE3A)
+{
+  frameTick = true;
+  if (frameActive || holdFrames || readState)
+    return;
+
+  // Swap in the pending schedule at the frame boundary
+  //
+  ServoSchedule *s = nextSchedule;
+  if (s)
+    nextSchedule = NULL;
+  else
+    s = frameSchedule;
+
+  if (s)
+    SRV_StartFrame(s);
+}
+
+
+static void SRV_ReadbackStep();
+
+
+/**
+ * Timer1 compare interrupt.
+ * Outputs the current servo event and programs the
+ * compare register for the next one.
+ */
+SIGNAL(SIG_OUTPUT_COMPARE1A)
+{
+  if (readState) {
+    SRV_ReadbackStep();
+    return;
+  }
+
+  const ServoEvent *e = nextEvent;
+  uint16_t  entry = OCR1A;
+
+  for (;;) {
+    // The event is at most 2*ISR_LEAD ahead here, see below,
+    // so the signed difference can't overflow.
+    //
+    uint16_t  due = frameStart + e->tick;
+    int16_t   ahead;
+    while ((ahead = due - TCNT1) > FINE_TICKS);
+
+    uint8_t late;
+    if (ahead >= 0) {
+      late = SRV_OutputAt(due, e->a, e->b, e->c);
+    }
+    else {
+      DDRA = e->a;  DDRB = e->b;  DDRC = e->c;
+      late = ahead < -255 ? 255 : -ahead;
+    }
+    if (late)
+      SRV_RecordLate(e, late);
+
+    if (e == frameEnd) {
+      // End of frame, all outputs are low now.
+      //
+      stats.frames++;
+      stats.frameTicks = e->tick;
+      stats.isrTicks   = isrTicks + (TCNT1 - entry);
+
+      TIMSK &= ~_BV(OCIE1A);
+      frameActive = false;
+      return;
+    }
+    e++;
+
+    // Leave the ISR if there is enough time to come back,
+    // otherwise wait for the next event in here. Events can
+    // be up to MAX_SERVO_TIME apart, more than a signed
+    // difference holds, so compare unsigned ticks since the
+    // frame start. Those only grow while the frame runs.
+    //
+    uint16_t now = TCNT1 - frameStart;
+    if (e->tick > now + 2*ISR_LEAD) {
+      OCR1A = frameStart + e->tick - ISR_LEAD;
+      break;
+    }
+
+    // Clustered edges could keep us in here for ~200us,
+    // longer than the UART receive FIFOs last at 500kbaud.
+    // If a character is waiting after ISR_MAX_HOLD, give
+    // the receive interrupt ISR_YIELD and come back. Edges
+    // due meanwhile are late, see SRV_GetJitter().
+    //
+    if ((uint16_t)(TCNT1 - entry) > ISR_MAX_HOLD &&
+        ((UCSR0A & _BV(RXC)) || (UCSR1A & _BV(RXC)))) {
+      OCR1A = TCNT1 + ISR_YIELD;
+      break;
+    }
+  }
+  nextEvent = e;
+  isrTicks += TCNT1 - entry;
+}
+
+
+/**
+ * Build the event table of a schedule.
+ *
+ * \param  s          schedule to build
+ * \param  positions  array of 24 servo target positions.
+ */
+static void SRV_BuildSchedule(ServoSchedule *s, unsigned *positions)
+{
+  ServoEvent *events = s->events;
+  uint16_t    t0     = TCNT1;
+
+  if (s->positions != positions)
+    memcpy(s->positions, positions, sizeof(s->positions));
+  s->feedbackGen = feedbackGen;
+  SRV_SortChannels(positions);
+
+  // Start-of-frame event: all pulses go high. It is written
+  // by the output stage like any other event, so the fixed
+  // DDRA/DDRB/DDRC write skew cancels out in the pulse widths.
+  //
+  events[0].tick = 0;
+  events[0].a    = 0;
+  events[0].b    = 0;
+  events[0].c    = 0;
+
+  // Merge port bits (they should sum up to 0x0fff)..
+  //
+  uint8_t   k=0, a=0, b=0, c=0;
+  uint16_t  prev = 0;
+  for (uint8_t i=0; i<24; i++) {
+    uint8_t   ch   = sortOrder[i];
+    uint16_t  tick = sortKeys[ch];
+    uint8_t   bit  = 1 << (ch & 7);
+
+    // Events closer than one output step can't be written
+    // separately. Round to the nearest feasible slot, so the
+    // error stays within EVENT_TICKS/2, see SRV_GetJitter().
+    //
+    if (tick >= prev + EVENT_TICKS/2) {
+      prev = tick > prev + EVENT_TICKS ? tick : prev + EVENT_TICKS;
+      k++;
+    }
+    if      (ch <  8)  a |= bit;
+    else if (ch < 16)  b |= bit;
+    else               c |= bit;
+
+    events[k].tick = prev;
+    events[k].a    = a;
+    events[k].b    = b;
+    events[k].c    = c;
+  }
+
+  // End-of-frame marker
+  //
+  k++;
+  events[k].tick = prev + EVENT_TICKS > MAX_SERVO_TIME ? prev + EVENT_TICKS : MAX_SERVO_TIME;
+  events[k].a    = a;
+  events[k].b    = b;
+  events[k].c    = c;
+  s->count = k+1;
+
+  s->valid = true;
+  stats.builds++;
+  stats.buildTicks = TCNT1 - t0;
+}
+
+
+/**
+ * Check if a schedule was built from the given positions
+ * and the current feedback offsets.
+ */
+static bool SRV_IsCached(ServoSchedule *s, unsigned *positions)
+{
+  return s->valid && !memcmp(s->positions, positions, sizeof(s->positions))
+                  && s->feedbackGen == feedbackGen;
+}
+
+
 /**
  * Set servo target positions.
  * 
+ * The event table for the next frame is built in the back
+ * buffer while the current frame is still being output, and
+ * swapped in at the next frame tick. If the positions did not
+ * change, the cached event table is used again.
+ *
  * \param  positions  array of 24 servo target positions.
  * \note   target positions are given as PWM pulse widths in CPU ticks.
  */
 void SRV_SetPositions(unsigned *positions)
 {
-  // Initialize and sort event table
+  // Select the back buffer. It is never touched by the output
+  // ISR, except for being swapped in, so withdraw it from the
+  // pending slot while it is being rebuilt.
   //
-  for (uint8_t i=0; i<24; i++) {
-    servoEvents[i].tick = positions[i];
-    if  (i<8)  { 
-      servoEvents[i].a = 1<<i;
-      servoEvents[i].b = 0;
-      servoEvents[i].c = 0;
-    }
-    else if (i<16) {
-      servoEvents[i].a = 0;
-      servoEvents[i].b = 1<<(i-8);
-      servoEvents[i].c = 0;
-    }
-    else {
-      servoEvents[i].a = 0;
-      servoEvents[i].b = 0;
-      servoEvents[i].c = 1<<(i-16);
-    }
+  uint8_t sreg = SREG;
+  cli();
+  ServoSchedule *s = frameSchedule;
+  ServoSchedule *back = (s == &schedules[0]) ? &schedules[1] : &schedules[0];
+  if (nextSchedule == back)
+    nextSchedule = NULL;
+  SREG = sreg;
+
+  if (!s || !SRV_IsCached(s, positions)) {
+    s = back;
+    if (!SRV_IsCached(s, positions))
+      SRV_BuildSchedule(s, positions);
   }
-  
-  qsort(servoEvents, 24, sizeof(ServoEvent), compare_uint16);
 
-  // Merge port bits (they should sum up to 0x0fff)..
+  // The Timer3 ISR reads the pointer byte by byte
+  //
+  sreg = SREG;
+  cli();
+  nextSchedule = s;
+  SREG = sreg;
+}
+
+
+/**
+ * Output the last target positions again.
+ * Rebuilds the event table after the calibration or the
+ * feedback offsets changed. Frames are not started if
+ * no target positions were set yet.
+ *
+ */
+void SRV_Refresh()
+{
+  // Both pointers are swapped by the Timer3 ISR
   //
-  uint8_t k=0, a=0, b=0, c=0;
-  for (uint8_t i=0; i<24;) {
-    uint16_t  tick = servoEvents[i].tick;
- 
-    // Merge entries that are less than one loop iteration apart.
-    // The loop will always execute for at least one iteration.
-    //
-    for (uint8_t j=i; j<24 && servoEvents[j].tick - tick < 30; j++) {
-      a |= servoEvents[j].a;
-      b |= servoEvents[j].b;
-      c |= servoEvents[j].c;
-      i++;
+  uint8_t sreg = SREG;
+  cli();
+  ServoSchedule *s = nextSchedule;
+  if (!s)
+    s = frameSchedule;
+  SREG = sreg;
+
+  if (s)
+    SRV_SetPositions(s->positions);
+}
+
+
+/**
+ * Set feedback offsets.
+ *
+ * The offsets are added to the target positions before
+ * calibration, when the next event table is built. They
+ * take effect with the next SRV_SetPositions() or
+ * SRV_Refresh().
+ *
+ * \param  offsets  array of 24 offsets in CPU ticks, NULL for none
+ */
+void SRV_SetFeedback(const int16_t *offsets)
+{
+  bool changed = false;
+  for (uint8_t i=0; i<24; i++) {
+    int16_t o = offsets ? offsets[i] : 0;
+    if (feedback[i] != o) {
+      feedback[i] = o;
+      changed = true;
     }
-    servoEvents[k].tick = tick;
-    servoEvents[k].a    = a;
-    servoEvents[k].b    = b;
-    servoEvents[k].c    = c;
-    k++;
+  }
+  if (changed)
+    feedbackGen++;
+}
+
+
+/**
+ * Set calibration table.
+ *
+ * The table is used in place and must stay valid. Call this
+ * again after modifying it, so cached schedules are rebuilt.
+ * Running frames use the new table from the next frame on.
+ *
+ * \param  calib  array of 24 calibration entries, NULL to disable
+ */
+void SRV_SetCalibration(const ServoCalib *calib)
+{
+  calibration = calib;
+  schedules[0].valid = false;
+  schedules[1].valid = false;
+  SRV_Refresh();
+}
+
+
+/**
+ * Fill a calibration table with neutral values.
+ *
+ * \param  calib  array of 24 calibration entries
+ */
+void SRV_DefaultCalibration(ServoCalib *calib)
+{
+  for (uint8_t i=0; i<24; i++) {
+    calib[i].offset = 0;
+    calib[i].scale  = 16384;
+    calib[i].min    = 0;
+    calib[i].max    = 0xffff;
+    calib[i].flags  = 0;
+  }
+}
+
+
+/**
+ * Set servo frame rate.
+ *
+ * \param  rate  frames per second (SRV_MIN_RATE..SRV_MAX_RATE)
+ */
+void SRV_SetFrameRate(uint16_t rate)
+{
+  if (rate < SRV_MIN_RATE)  rate = SRV_MIN_RATE;
+  if (rate > SRV_MAX_RATE)  rate = SRV_MAX_RATE;
+
+  uint8_t sreg = SREG;
+  cli();
+  OCR3A = F_CPU/8 / rate - 1;
+  if (TCNT3 > OCR3A)
+    TCNT3 = 0;
+  SREG = sreg;
+}
+
+
+/**
+ * Check for a frame tick.
+ * Returns true once for every frame timer period.
+ */
+bool SRV_FrameTick()
+{
+  if (!frameTick)
+    return false;
+  frameTick = false;
+  return true;
+}
+
+
+/**
+ * Suspend frame output, e.g. for readback.
+ * A running frame is completed.
+ *
+ * \param  hold  true to suspend, false to resume
+ */
+void SRV_HoldFrames(bool hold)
+{
+  holdFrames = hold;
+}
+
+
+/**
+ * Check for a servo frame in progress.
+ *
+ * \return  true while the output ISR is generating pulses.
+ */
+bool SRV_IsBusy()
+{
+  return frameActive;
+}
+
+
+/**
+ * Get worst-case edge error by channel.
+ *
+ * Edges written on time are exact to one CPU tick, but are
+ * placed on the event grid of SRV_BuildSchedule(): edges closer
+ * than EVENT_TICKS are merged or moved apart, by up to
+ * EVENT_TICKS/2. This placement error of the current schedule
+ * is included. On top of that, an edge is late if the compare
+ * interrupt was held off by another interrupt or yielded to a
+ * received character (up to ISR_YIELD). The lateness values
+ * are cleared after reading.
+ *
+ * \param  late  array of 24 maximum errors in ticks since last call
+ */
+void SRV_GetJitter(uint8_t *late)
+{
+  for (uint8_t i=0; i<24; i++) {
+    uint8_t sreg = SREG;
+    cli();
+    late[i]    = maxLate[i];
+    maxLate[i] = 0;
+    SREG = sreg;
   }
 
-  // Reset timer and begin servo output.
+  // Placement error of the schedule being output. It is
+  // only rebuilt by the main loop, so it can't change here,
+  // but the Timer3 ISR swaps the pointer. Skip it if it's
+  // stale, the next one replaces it soon.
   //
-  TCCR1B = 0;
-  TCNT1  = 0; 
-  TCCR1B = _BV(CS10);
-  TIFR  |= _BV(OCF1A);
+  uint8_t sreg = SREG;
+  cli();
+  ServoSchedule *s = frameSchedule;
+  SREG = sreg;
 
-  DDRA = 0x00;  DDRB = 0x00;  DDRC = 0x00;
-  ServoEvent *e = servoEvents;
-  for (uint8_t i=0; i<k; i++) {
-    while (TCNT1 < e->tick);
-    DDRA = e->a;
-    DDRB = e->b;
-    DDRC = e->c;
-    e++;
+  if (!s || !s->valid || s->feedbackGen != feedbackGen)
+    return;
+
+  uint8_t a = 0, b = 0, c = 0;
+  for (const ServoEvent *e = s->events; e < &s->events[s->count-1]; e++) {
+    uint8_t set[3] = { e->a & ~a, e->b & ~b, e->c & ~c };
+    a = e->a;  b = e->b;  c = e->c;
+
+    for (uint8_t port=0; port<3; port++) {
+      uint8_t ch = port*8;
+      for (uint8_t m = set[port]; m; m >>= 1, ch++) {
+        if (!(m & 1))
+          continue;
+        uint16_t tick  = SRV_EdgeTick(s->positions, ch);
+        uint16_t error = e->tick > tick ? e->tick - tick : tick - e->tick;
+        if (error > late[ch])
+          late[ch] = error;
+      }
+    }
   }
-  loop_until_bit_is_set(TIFR, OCF1A);
+}
+
+
+/**
+ * Get servo engine statistics.
+ *
+ * \param  s  receives a consistent copy of the statistics
+ */
+void SRV_GetStats(SRV_Stats *s)
+{
+  uint8_t sreg = SREG;
+  cli();
+  *s = stats;
+  SREG = sreg;
 }
 
 
 /**
- * Read back current servo positions.
+ * Start a servo position readback.
+ *
+ * The request pulse and the wait for the answer are timed by
+ * the Timer1 compare interrupt, which then samples the answer,
+ * see SRV_ReadbackStep(). Call it in place of a servo frame,
+ * see SRV_HoldFrames(), and fetch the result with
+ * SRV_PollReadback().
  *
- * \param positions  array of 24 current servo positions.
- * \note   
+ * \return false, if a frame or readback is still running
+ * \note
  *   This function will only work with special Kondo-ICS
- *   compatible servos. Target positions are given as PWM
- *   pulse widths in CPU ticks.
+ *   compatible servos.
  */
-void SRV_GetPositions(unsigned *positions)
+bool SRV_StartReadback()
 {
-  TCCR1B = 0;
-  TCNT1  = 0;
-  TCCR1B = _BV(CS10);
+  uint8_t sreg = SREG;
+  cli();
+  if (frameActive || readState) {
+    SREG = sreg;
+    return false;
+  }
 
   // Send 100us pulse
   //
-  OCR1A  = US_TICKS(100);
-  TIFR  |= _BV(OCF1A);
-
+  readStart = TCNT1;
+  readState = READ_REQUEST;
+  OCR1A  = readStart + US_TICKS(100);
+  TIFR   = _BV(OCF1A);
+  TIMSK |= _BV(OCIE1A);
   DDRA = 0x00;  DDRB = 0x00;  DDRC = 0x00;
-  loop_until_bit_is_set(TIFR, OCF1A);
-  DDRA = 0xff;  DDRB = 0xff;  DDRC = 0xff;
+  SREG = sreg;
+  return true;
+}
 
-  // Servo output starts at 150us
-  //
-  OCR1A  = US_TICKS(150);
-  TIFR  |= _BV(OCF1A);
-  loop_until_bit_is_set(TIFR, OCF1A);
-  DDRA = 0x00;  DDRB = 0x00;  DDRC = 0x00;
 
-  // Skip low phase of output
-  //
-  OCR1A  = US_TICKS(300);
-  TIFR  |= _BV(OCF1A);
-  loop_until_bit_is_set(TIFR, OCF1A);
-  
-  // Read positions
+/**
+ * Advance the readback. Called from the Timer1 compare
+ * interrupt at the end of each readback phase.
+ *
+ */
+static void SRV_ReadbackStep()
+{
+  uint16_t t0 = readStart;
+
+  switch (readState) {
+    case READ_REQUEST:
+      // Servo output starts at 150us
+      //
+      DDRA = 0xff;  DDRB = 0xff;  DDRC = 0xff;
+      OCR1A     = t0 + US_TICKS(150);
+      readState = READ_ANSWER;
+      return;
+
+    case READ_ANSWER:
+      // Skip low phase of output
+      //
+      DDRA = 0x00;  DDRB = 0x00;  DDRC = 0x00;
+      OCR1A     = t0 + US_TICKS(300);
+      readState = READ_SKIP;
+      return;
+  }
+
+  // Read positions. There is no pin change interrupt on the
+  // servo ports, so the answer is sampled in here, with the
+  // other interrupts enabled. Pins and timer are captured
+  // together with interrupts disabled, so an interrupt can
+  // only widen the sample interval an edge falls into, never
+  // skew its time. Edges are timestamped at the middle of
+  // that interval, which is SAMPLE_TICKS wide (1.25us)
+  // without interrupts. The UART and ADC handlers are short,
+  // but an attitude update runs for hundreds of us, so the
+  // Timer2 interrupt is held off until the answer is in. It
+  // stays pending and runs right after, its period is longer
+  // than the readback.
   //
-  OCR1A  = MAX_SERVO_TIME + US_TICKS(300);
-  TIFR  |= _BV(OCF1A);
-
-  ServoEvent *e  = servoEvents;
-  uint8_t  pina = 0xff, pinb = 0xff, pinc = 0xff;
-  uint8_t  a    = 0xff, b    = 0xff, c    = 0xff;
-
-  while (!(TIFR & _BV(OCF1A))) {
-    pina &= PINA;  pinb &= PINB;  pinc &= PINC;
-    if ((pina ^ a) | (pinb ^ b) | (pinc ^ c)) {
-      e->tick  = TCNT1;
-      e->a = a = pina;
-      e->b = b = pinb;
-      e->c = c = pinc;
-      e++;
-    }
+  ServoEvent *e = readEvents;
+  uint8_t     a = 0xff, b = 0xff, c = 0xff;
+  uint16_t    t = TCNT1;
+  uint8_t     att = TIMSK & _BV(OCIE2);
+
+  TIMSK &= ~(_BV(OCIE1A) | _BV(OCIE2));
+  OCR1A  = t0 + MAX_SERVO_TIME + US_TICKS(300);
+  TIFR   = _BV(OCF1A);
+  sei();
+  for (;;) {
+    uint8_t   pa = a, pb = b, pc = c;
+    uint16_t  prev = SRV_SampleEdge(&pa, &pb, &pc, &t);
+    if (pa == a && pb == b && pc == c)
+      break;
+
+    e->tick = (prev - t0) + (t - prev)/2;
+    e->a = a = pa;
+    e->b = b = pb;
+    e->c = c = pc;
+    e++;
   }
+  cli();
   DDRA = 0xFF;  DDRB = 0xFF;  DDRC = 0xFF;
-  e->tick = 0; e->a = 0; e->b = 0; e->c = 0;
+  TIMSK |= att;
+
+  readEnd   = e;
+  readState = READ_DONE;
+}
+
+
+/**
+ * Get the result of a readback, see SRV_StartReadback().
+ * Call from the main loop, never waits.
+ *
+ * \param positions  array of 24 current servo positions,
+ *                   with calibration removed.
+ * \return true once, when the readback is complete and
+ *         positions was filled in
+ * \note
+ *   Target positions are given as PWM pulse widths in CPU ticks.
+ */
+bool SRV_PollReadback(unsigned *positions)
+{
+  if (readState != READ_DONE)
+    return false;
 
-  // Reconstruct servo positions
+  // Reconstruct servo positions. Servos that don't
+  // answer read as -250us, like they always did.
   //
-  while (e >= servoEvents) {
-    uint16_t tick = e->tick - US_TICKS(250);
-    a = ~e->a;
-    b = ~e->b;
-    c = ~e->c;
-    e--;
-    if (a & 0x01)  positions[ 0] = tick;
-    if (a & 0x02)  positions[ 1] = tick;
-    if (a & 0x04)  positions[ 2] = tick;
-    if (a & 0x08)  positions[ 3] = tick;
-    if (a & 0x10)  positions[ 4] = tick;
-    if (a & 0x20)  positions[ 5] = tick;
-    if (a & 0x40)  positions[ 6] = tick;
-    if (a & 0x80)  positions[ 7] = tick;
-
-    if (b & 0x01)  positions[ 8] = tick;
-    if (b & 0x02)  positions[ 9] = tick;
-    if (b & 0x04)  positions[10] = tick;
-    if (b & 0x08)  positions[11] = tick;
-    if (b & 0x10)  positions[12] = tick;
-    if (b & 0x20)  positions[13] = tick;
-    if (b & 0x40)  positions[14] = tick;
-    if (b & 0x80)  positions[15] = tick;
-
-    if (c & 0x01)  positions[16] = tick;
-    if (c & 0x02)  positions[17] = tick;
-    if (c & 0x04)  positions[18] = tick;
-    if (c & 0x08)  positions[19] = tick;
-    if (c & 0x10)  positions[20] = tick;
-    if (c & 0x20)  positions[21] = tick;
-    if (c & 0x40)  positions[22] = tick;
-    if (c & 0x80)  positions[23] = tick;
+  uint32_t answered = 0;
+  for (uint8_t i=0; i<24; i++)
+    positions[i] = -US_TICKS(250);
+
+  uint8_t a = 0xff, b = 0xff, c = 0xff;
+  for (ServoEvent *r = readEvents; r < readEnd; r++) {
+    uint8_t   fell[3] = { a & ~r->a, b & ~r->b, c & ~r->c };
+    uint16_t  tick    = r->tick - US_TICKS(250);
+    a = r->a;  b = r->b;  c = r->c;
+
+    for (uint8_t port=0; port<3; port++) {
+      uint8_t ch = port*8;
+      for (uint8_t m = fell[port]; m; m >>= 1, ch++) {
+        if (m & 1) {
+          positions[ch] = tick;
+          answered |= 1UL << ch;
+        }
+      }
+    }
+  }
+
+  if (calibration) {
+    for (uint8_t i=0; i<24; i++)
+      if (answered & (1UL << i))
+        positions[i] = SRV_Uncalibrate(&calibration[i], positions[i]);
   }
+
+  readState = READ_IDLE;
+  return true;
 }
 
 
@@ -230,4 +969,20 @@ void SRV_Init()
   PORTA = 0x00;  DDRA  = 0xff;
   PORTB = 0x00;  DDRB  = 0xff;
   PORTC = 0x00;  DDRC  = 0xff;
+
+  for (uint8_t i=0; i<24; i++)
+    sortOrder[i] = i;
+
+  // Timer1 runs freely at full CPU clock. Servo frames and
+  // readback are timed relative to its current value.
+  //
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);
+
+  // Timer3 is the frame timer, CTC mode at F_CPU/8
+  //
+  TCCR3A  = 0;
+  TCCR3B  = _BV(WGM32) | _BV(CS31);
+  SRV_SetFrameRate(SRV_DEFAULT_RATE);
+  ETIMSK |= _BV(OCIE3A);
 }
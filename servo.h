@@ -10,8 +10,56 @@
 #ifndef SERVO_H
 #define SERVO_H
 
+#include <inttypes.h>
+#include <stdbool.h>
+
+/**
+ * Servo engine statistics.
+ */
+typedef struct {
+  uint16_t  frames;      ///< Number of servo frames output
+  uint16_t  frameTicks;  ///< Length of last frame in CPU ticks
+  uint16_t  isrTicks;    ///< CPU ticks spent in the output ISR during last frame
+  uint16_t  builds;      ///< Number of event tables built (not taken from cache)
+  uint16_t  buildTicks;  ///< CPU ticks needed for the last build
+  uint16_t  lateEdges;   ///< Number of edges written late
+} SRV_Stats;
+
+/**
+ * Per-servo calibration.
+ *
+ * Positions are mirrored around SRV_CENTER if SRV_INVERT is set,
+ * scaled around SRV_CENTER, trimmed by offset and clamped to
+ * min..max before the event table is built.
+ */
+typedef struct {
+  int16_t   offset;   ///< Trim in CPU ticks
+  int16_t   scale;    ///< Gain in 2.14 fixed point (16384 = 1.0)
+  uint16_t  min;      ///< Lower limit in CPU ticks
+  uint16_t  max;      ///< Upper limit in CPU ticks
+  uint8_t   flags;    ///< SRV_INVERT
+} ServoCalib;
+
+#define SRV_CENTER   ((uint16_t)(1500 * (F_CPU/1000000)))  ///< Neutral position (1.5ms)
+#define SRV_INVERT   0x01                                  ///< Reverse direction
+
+#define SRV_MIN_RATE       50     ///< Minimum frame rate in Hz
+#define SRV_MAX_RATE       300    ///< Maximum frame rate in Hz
+#define SRV_DEFAULT_RATE   50     ///< Frame rate after reset
+
+extern void SRV_SetCalibration(const ServoCalib *calib);
+extern void SRV_DefaultCalibration(ServoCalib *calib);
 extern void SRV_SetPositions(unsigned *target);
-extern void SRV_GetPositions(unsigned *current);
+extern void SRV_SetFeedback(const int16_t *offsets);
+extern void SRV_Refresh();
+extern bool SRV_StartReadback();
+extern bool SRV_PollReadback(unsigned *current);
+extern void SRV_SetFrameRate(uint16_t rate);
+extern bool SRV_FrameTick();
+extern void SRV_HoldFrames(bool hold);
+extern bool SRV_IsBusy();
+extern void SRV_GetStats(SRV_Stats *stats);
+extern void SRV_GetJitter(uint8_t *late);
 extern void SRV_Init();
 
 #endif
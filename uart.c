@@ -11,8 +11,11 @@
 // include files -----
 //
 #include "uart.h"
+#include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/signal.h>
+#include <avr/interrupt.h>
+#include <avr/delay.h>
 
 #define  UART_RX_BUFFER_MASK  (UART_RX_BUFFER_SIZE - 1)
 #define  UART_TX_BUFFER_MASK  (UART_TX_BUFFER_SIZE - 1)
@@ -25,114 +28,333 @@
   #error TX buffer size is not a power of 2
 #endif
 
-static volatile char    UART_RxBuf[UART_RX_BUFFER_SIZE];
-static volatile char    UART_TxBuf[UART_TX_BUFFER_SIZE];
-static          uint8_t UART_RxHead, UART_TxTail;
-static volatile uint8_t UART_RxTail, UART_TxHead;
+/**
+ * Ring buffers of one serial port.
+ * They are bypassed while a handler is installed,
+ * so they only need to hold stdio traffic.
+ *
+ */
+typedef struct {
+  volatile char    rxBuf[UART_RX_BUFFER_SIZE];
+  volatile char    txBuf[UART_TX_BUFFER_SIZE];
+  uint8_t          rxHead, txTail;
+  volatile uint8_t rxTail, txHead;
+  UART_RxHandler   rxHandler;
+  UART_TxHandler   txHandler;
+  unsigned         divider;
+  volatile uint8_t overruns;
+} UartPort;
 
+static UartPort  ports[UART_PORTS];
 
-SIGNAL(SIG_UART0_RECV)
+
+/**
+ * Store a received character, or pass it to the
+ * receive handler. Inlined into the receive interrupts.
+ *
+ * The handler runs with interrupts enabled, so it may
+ * be preempted by the servo engine. Only the receive
+ * interrupt of its own port is masked meanwhile, the
+ * UART's receive FIFO holds the next character.
+ *
+ */
+static inline void ReceiveChar(uint8_t port, char c)
 {
-  char c = UDR0;
-  uint8_t tail = (UART_RxTail+1) & UART_RX_BUFFER_MASK;
-  if (tail != UART_RxHead) {
-    UART_RxTail = tail;
-    UART_RxBuf[tail] = c;
+  UartPort *p = &ports[port];
+
+  if (p->rxHandler) {
+    if (port) UCSR1B &= ~_BV(RXCIE); else UCSR0B &= ~_BV(RXCIE);
+    sei();
+    p->rxHandler(port, c);
+    cli();
+    if (port) UCSR1B |=  _BV(RXCIE); else UCSR0B |=  _BV(RXCIE);
+    return;
+  }
+
+  uint8_t tail = (p->rxTail+1) & UART_RX_BUFFER_MASK;
+  if (tail != p->rxHead) {
+    p->rxTail = tail;
+    p->rxBuf[tail] = c;
   }
 }
 
 
+/**
+ * Get the next character to send from the transmit
+ * handler or the buffer. Inlined into the data
+ * register empty interrupts.
+ *
+ * \return  character, or -1 if there is nothing to send
+ */
+static inline int TransmitChar(uint8_t port)
+{
+  UartPort *p = &ports[port];
+  if (p->txHandler)
+    return p->txHandler(port);
+
+  uint8_t head = p->txHead;
+  if (p->txTail == head)
+    return -1;
+
+  head = (head+1) & UART_TX_BUFFER_MASK;
+  p->txHead = head;
+  return (uint8_t)p->txBuf[head];
+}
+
+
+/**
+ * Enable the data register empty interrupt of a port.
+ * Call after new data has been made available to the
+ * transmit handler.
+ *
+ * \param  port  serial port
+ */
+void UART_StartTx(uint8_t port)
+{
+  if (port)
+    UCSR1B |= _BV(UDRIE1);
+  else
+    UCSR0B |= _BV(UDRIE0);
+}
+
+
+SIGNAL(SIG_UART0_RECV)
+{
+  if (UCSR0A & _BV(DOR))
+    ports[0].overruns++;
+  ReceiveChar(0, UDR0);
+}
+
+
 SIGNAL(SIG_UART1_RECV)
 {
-  char c = UDR1;
-  uint8_t tail = (UART_RxTail+1) & UART_RX_BUFFER_MASK;
-  if (tail != UART_RxHead) {
-    UART_RxTail = tail;
-    UART_RxBuf[tail] = c;
-  }
+  if (UCSR1A & _BV(DOR))
+    ports[1].overruns++;
+  ReceiveChar(1, UDR1);
 }
 
 
 SIGNAL(SIG_UART0_DATA)
 {
-  uint8_t head = UART_TxHead;
-  if (UART_TxTail != head) {
-    head = (head+1) & UART_TX_BUFFER_MASK;
-    UART_TxHead = head;
-    UDR0 = UART_TxBuf[head];
-    UDR1 = UART_TxBuf[head];
-  }
-  else {
+  int c = TransmitChar(0);
+  if (c >= 0)
+    UDR0 = c;
+  else
     UCSR0B &= ~_BV(UDRIE0);
-  }
 }
 
 
-int UART_GetChar()
+SIGNAL(SIG_UART1_DATA)
+{
+  int c = TransmitChar(1);
+  if (c >= 0)
+    UDR1 = c;
+  else
+    UCSR1B &= ~_BV(UDRIE1);
+}
+
+
+int UART_GetChar(uint8_t port)
 {    
-  while (UART_RxTail == UART_RxHead)
+  UartPort *p = &ports[port];
+
+  while (p->rxTail == p->rxHead)
     wdt_reset();
 
-  uint8_t head = (UART_RxHead+1) & UART_RX_BUFFER_MASK;
-  uint8_t data = UART_RxBuf[head];
-  UART_RxHead  = head; 
+  uint8_t head = (p->rxHead+1) & UART_RX_BUFFER_MASK;
+  uint8_t data = p->rxBuf[head];
+  p->rxHead = head; 
 
   return data;
 }
 
 
-int UART_PutChar(char data)
+int UART_PutChar(uint8_t port, char data)
 {
-  uint8_t tail = (UART_TxTail+1) & UART_TX_BUFFER_MASK;
+  UartPort *p = &ports[port];
+
+  // The transmit interrupt doesn't drain the ring while
+  // a handler is installed, drop the character.
+  //
+  if (p->txHandler)
+    return -1;
+
+  uint8_t tail = (p->txTail+1) & UART_TX_BUFFER_MASK;
   
-  while (tail == UART_TxHead)
+  while (tail == p->txHead)
     wdt_reset();
   
-  UART_TxBuf[tail] = data;
-  UART_TxTail = tail;
+  p->txBuf[tail] = data;
+  p->txTail = tail;
 
-  UCSR0B |= _BV(UDRIE);
+  UART_StartTx(port);
   return 0;
 }
 
 
-void UART_PutString(const char *s)
+void UART_PutString(uint8_t port, const char *s)
 {
   while (*s) 
-    UART_PutChar(*s++);
+    UART_PutChar(port, *s++);
 }
 
 
-void UART_PutString_P(PGM_P s)
+void UART_PutString_P(uint8_t port, PGM_P s)
 {
   register char c;
   while ((c = pgm_read_byte(s++))) 
-    UART_PutChar(c);
+    UART_PutChar(port, c);
 }
 
 
-int UART_CharsAvail()
+int UART_CharsAvail(uint8_t port)
 {
-  return (UART_RxTail - UART_RxHead) & UART_RX_BUFFER_MASK;
+  UartPort *p = &ports[port];
+  return (p->rxTail - p->rxHead) & UART_RX_BUFFER_MASK;
+}
+
+
+/**
+ * Get and clear the receive overrun count of a port.
+ * Counts characters lost because the receive FIFO
+ * was full (DOR), modulo 256.
+ *
+ * \param  port  serial port
+ */
+uint8_t UART_Overruns(uint8_t port)
+{
+  uint8_t sreg = SREG;
+  cli();
+  uint8_t n = ports[port].overruns;
+  ports[port].overruns = 0;
+  SREG = sreg;
+  return n;
+}
+
+
+/**
+ * Set the receive handler of a port.
+ * If set, received characters are passed to the handler
+ * from the receive interrupt instead of being buffered.
+ *
+ * \param  port     serial port
+ * \param  handler  receive handler, 0 to buffer characters
+ */
+void UART_SetRxHandler(uint8_t port, UART_RxHandler handler)
+{
+  uint8_t sreg = SREG;
+  cli();
+  ports[port].rxHandler = handler;
+  SREG = sreg;
+}
+
+
+/**
+ * Set the transmit handler of a port.
+ * If set, the data register empty interrupt takes the
+ * characters to send from the handler instead of the
+ * buffer. The handler returns -1 when it has nothing
+ * to send, UART_StartTx() restarts the interrupt.
+ *
+ * \param  port     serial port
+ * \param  handler  transmit handler, 0 to send from the buffer
+ */
+void UART_SetTxHandler(uint8_t port, UART_TxHandler handler)
+{
+  uint8_t sreg = SREG;
+  cli();
+  ports[port].txHandler = handler;
+  SREG = sreg;
+}
+
+
+/**
+ * stdio output, for use with fdevopen().
+ *
+ */
+int UART_StdioPut(char c)
+{
+  return UART_PutChar(UART_STDIO_PORT, c);
+}
+
+
+/**
+ * stdio input, for use with fdevopen().
+ *
+ */
+int UART_StdioGet()
+{
+  return UART_GetChar(UART_STDIO_PORT);
+}
+
+
+/**
+ * Set the baud rate registers of a port.
+ *
+ */
+static void SetDivider(uint8_t port, unsigned divider)
+{
+  ports[port].divider = divider;
+  if (port) {
+    UBRR1H = ((uint8_t)(divider>>8)) & ~0x80;
+    UBRR1L = (uint8_t)divider;
+    UCSR1A = divider & 0x8000 ? _BV(U2X) : 0;
+  }
+  else {
+    UBRR0H = ((uint8_t)(divider>>8)) & ~0x80;
+    UBRR0L = (uint8_t)divider;
+    UCSR0A = divider & 0x8000 ? _BV(U2X) : 0;
+  }
+}
+
+
+/**
+ * Change the baud rate of a port.
+ * Waits until the transmitter is idle, so everything
+ * already queued still goes out at the old rate.
+ *
+ * \param  port     serial port
+ * \param  divider  see UART_DIVIDER() and UART_DIVIDER_U2X()
+ */
+void UART_SetBaud(uint8_t port, unsigned divider)
+{
+  UartPort *p = &ports[port];
+
+  if (port)
+    while ((UCSR1B & _BV(UDRIE1)) || !(UCSR1A & _BV(UDRE)))
+      wdt_reset();
+  else
+    while ((UCSR0B & _BV(UDRIE0)) || !(UCSR0A & _BV(UDRE)))
+      wdt_reset();
+
+  // The data register is empty, give the shift register
+  // another 10 bit times. A bit takes (UBRR+1) * 8 cycles
+  // with U2X and twice that without, _delay_loop_2()
+  // takes 4 cycles per loop.
+  //
+  uint16_t bitLoops = ((p->divider & 0x0fff) + 1) * (p->divider & 0x8000 ? 2 : 4);
+  for (uint8_t i=0; i<10; i++) {
+    _delay_loop_2(bitLoops);
+    wdt_reset();
+  }
+
+  SetDivider(port, divider);
 }
 
 
-void UART_Init(unsigned divider)
+void UART_Init(uint8_t port, unsigned divider)
 {
-  UART_TxHead = 0; UART_TxTail = 0;
-  UART_RxHead = 0; UART_RxTail = 0;
+  UartPort *p = &ports[port];
+  p->txHead = 0; p->txTail = 0;
+  p->rxHead = 0; p->rxTail = 0;
 
-  // Enable receiver and transmitter on both UARTs
+  // Enable receiver and transmitter
   // (remember to add pullup-resistors to prevent
   //  garbage characters when device is disconncted)
   //
-  UBRR0H = ((uint8_t)(divider>>8)) & ~0x80;
-  UBRR1H = ((uint8_t)(divider>>8)) & ~0x80;
-  UBRR0L = (uint8_t)divider;
-  UBRR1L = (uint8_t)divider;
-
-  UCSR0A = divider & 0x8000 ? _BV(U2X) : 0;
-  UCSR1A = divider & 0x8000 ? _BV(U2X) : 0;
-  UCSR0B = _BV(RXCIE) | _BV(RXEN) | _BV(TXEN);
-  UCSR1B = _BV(RXCIE) | _BV(RXEN) | _BV(TXEN);
+  SetDivider(port, divider);
+  if (port)
+    UCSR1B = _BV(RXCIE) | _BV(RXEN) | _BV(TXEN);
+  else
+    UCSR0B = _BV(RXCIE) | _BV(RXEN) | _BV(TXEN);
 }
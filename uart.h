@@ -10,20 +10,43 @@
 #ifndef UART_H
 #define UART_H
 
+#include <inttypes.h>
 #include <avr/pgmspace.h>
 
 #define UART_DIVIDER(baudRate)      ((F_CPU)/((baudRate)*16l)-1)
 #define UART_DIVIDER_U2X(baudRate)  (((F_CPU)/((baudRate)*8l)-1) | 0x8000)
 
-#define UART_RX_BUFFER_SIZE  256     ///< Size of receive buffer
-#define UART_TX_BUFFER_SIZE  128     ///< Size of transmit buffer
+#define UART_PORTS           2       ///< Number of serial ports
+#define UART_STDIO_PORT      0       ///< Port used for stdio
 
-extern  void UART_Init(unsigned divider);
-extern  int  UART_GetChar();
-extern  int  UART_CharsAvail();
-extern  int  UART_PutChar(char c);
-extern  void UART_PutString(const char *s);
-extern  void UART_PutString_P(PGM_P  s);
+#define UART_RX_BUFFER_SIZE  16      ///< Size of receive buffer (per port)
+#define UART_TX_BUFFER_SIZE  16      ///< Size of transmit buffer (per port)
 
-#endif
+/**
+ * Receive handler, called from the receive interrupt.
+ */
+typedef void (*UART_RxHandler)(uint8_t port, char c);
+
+/**
+ * Transmit handler, called from the data register empty
+ * interrupt. Returns the next character or -1.
+ */
+typedef int  (*UART_TxHandler)(uint8_t port);
+
+extern  void UART_Init(uint8_t port, unsigned divider);
+extern  void UART_SetBaud(uint8_t port, unsigned divider);
+extern  int  UART_GetChar(uint8_t port);
+extern  int  UART_CharsAvail(uint8_t port);
+extern  uint8_t UART_Overruns(uint8_t port);
+extern  int  UART_PutChar(uint8_t port, char c);
+extern  void UART_PutString(uint8_t port, const char *s);
+extern  void UART_PutString_P(uint8_t port, PGM_P  s);
 
+extern  void UART_SetRxHandler(uint8_t port, UART_RxHandler handler);
+extern  void UART_SetTxHandler(uint8_t port, UART_TxHandler handler);
+extern  void UART_StartTx(uint8_t port);
+
+extern  int  UART_StdioPut(char c);
+extern  int  UART_StdioGet();
+
+#endif